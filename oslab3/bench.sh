@@ -0,0 +1,10 @@
+#!/bin/bash
+
+# runs fifo_bench with 2, 4 and 8 producers against as many consumers
+# expects fifo_lkm.ko to be loaded, e.g.: sudo insmod fifo_lkm.ko size=64
+
+items=${1:-100000}
+
+for n in 2 4 8; do
+	./fifo_bench -p $n -c $n -n $items
+done
@@ -0,0 +1,18 @@
+#!/bin/bash
+
+# compares the mutex write path with the combining one (combine=1)
+# at increasing producer counts against two consumers
+# reloads fifo_lkm, so no other module may use it
+
+items=${1:-100000}
+
+for mode in 0 1; do
+	echo "=== combine=$mode"
+	sudo insmod fifo_lkm.ko size=64 combine=$mode
+
+	for n in 1 2 4 8 16; do
+		./fifo_bench -p $n -c 2 -n $items
+	done
+
+	sudo rmmod fifo_lkm
+done
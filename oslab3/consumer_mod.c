@@ -10,6 +10,7 @@
 
 // forward declarations
 void consume(struct work_struct*);
+void drain(struct work_struct*);
 
 MODULE_AUTHOR("Name");
 MODULE_DESCRIPTION("Lab Solution");
@@ -27,39 +28,102 @@ module_param(mod_name, charp, 0);
 static int interval_ms = 1000;
 module_param(interval_ms, int, 0);
 
+// module parameter to drain the fifo whenever it notifies new items,
+// instead of one get every interval_ms
+static bool event = 0;
+module_param(event, bool, 0);
+
 // termination controll
 static int continue_exec = 1;
 
 // delayed work item
 DECLARE_DELAYED_WORK(work, consume);
+
+// work item of the event mode
+DECLARE_WORK(drain_work, drain);
+
+// items per run of drain_work, it requeues itself for the rest
+#define DRAIN_BATCH 64
 // -------- globals end --------------------------------------------------
 
 // import from other modules
 extern struct data_item* get(const char*);
+extern struct data_item* get_nowait(const char*);
 extern void free_di(struct data_item*);
 extern int request_kill_read(const char*);
+extern int register_notify(const char*, void (*)(void*), void*);
+extern void arm_notify(const char*);
+extern void unregister_notify(const char*);
 
 void stop_exec(struct work_struct* ws)
 {
 	request_kill_read(THIS_MODULE->name);
 }
 
+void show(struct data_item* di)
+{
+	printk(KERN_INFO "[%s][%lu][%llu] %s\n",
+				mod_name, di->qid, di->time, di->msg);
+	free_di(di);	
+}
+
 void consume(struct work_struct* ws)
 {
 	struct data_item* di = get(THIS_MODULE->name);
 	if (IS_ERR(di))
 		printk(KERN_INFO "--- %s: get failed (may have been killed)\n", mod_name);
 	else
-	{
-		printk(KERN_INFO "[%s][%lu][%llu] %s\n",
-					mod_name, di->qid, di->time, di->msg);
-		free_di(di);	
-	}
+		show(di);
 
 	if (continue_exec)
 		queue_delayed_work(wqs, &work, interval_ms*HZ/1000);
 }
 
+/*
+ * called by the fifo on a new item once armed, must not sleep
+ */
+void notified(void* ctx)
+{
+	queue_work(wqs, &drain_work);
+}
+
+/*
+ * event mode: read everything there is, then arm the notification
+ * and look once more, an item written in between is either read here
+ * or notified. Reads at most DRAIN_BATCH items per run.
+ */
+void drain(struct work_struct* ws)
+{
+	int armed = 0;
+	int n = 0;
+	struct data_item* di;
+
+	while (continue_exec)
+	{
+		// do not keep the worker while producers keep up
+		if (n == DRAIN_BATCH)
+		{
+			queue_work(wqs, &drain_work);
+			break;
+		}
+
+		di = get_nowait(THIS_MODULE->name);
+		if (!IS_ERR(di))
+		{
+			show(di);
+			armed = 0;
+			++n;
+		}
+		else if (armed)
+			break;
+		else
+		{
+			arm_notify(THIS_MODULE->name);
+			armed = 1;
+		}
+	}
+}
+
 /*
  * initializes the LKM
  * calls functions to create/init the following:
@@ -67,6 +131,8 @@ void consume(struct work_struct* ws)
  */
 static int __init consumer_mod_init(void)
 {
+	int err;
+
 	wqs = alloc_workqueue(mod_name, WQ_UNBOUND, 2);
 	if (0 == wqs)
 	{
@@ -74,7 +140,21 @@ static int __init consumer_mod_init(void)
 		return -ENOMEM;
 	}
 
-	queue_delayed_work(wqs, &work, interval_ms*HZ/1000);
+	if (event)
+	{
+		err = register_notify(THIS_MODULE->name, notified, 0);
+		if (err)
+		{
+			printk(KERN_INFO "--- %s: register_notify failed!\n", mod_name);
+			destroy_workqueue(wqs);
+			return -err;
+		}
+
+		// items may be waiting already, the first drain arms
+		queue_work(wqs, &drain_work);
+	}
+	else
+		queue_delayed_work(wqs, &work, interval_ms*HZ/1000);
 
 	printk(KERN_INFO "--- %s: is being loaded.\n", mod_name);
 	return 0;
@@ -86,6 +166,17 @@ static void __exit consumer_mod_cleanup(void)
 	continue_exec = 0;
 
 	printk(KERN_INFO "--- %s: unloading...\n", mod_name);
+
+	// drain never blocks, no kill request needed
+	if (event)
+	{
+		unregister_notify(THIS_MODULE->name);
+		cancel_work_sync(&drain_work);
+		destroy_workqueue(wqs);
+		printk(KERN_INFO "--- %s: unloading complete!\n", mod_name);
+		return;
+	}
+
 	printk(KERN_INFO "--- %s: cancel remaining work\n", mod_name);
 	cancel_delayed_work(&work);
 
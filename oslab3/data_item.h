@@ -1,3 +1,10 @@
+#ifndef INCLUDE_DATA_ITEM
+#define INCLUDE_DATA_ITEM
+
+#include <linux/kref.h>
+
+struct fifo_ack;
+
 /**
  * inside an extra header to include only this struct in consumer_mod.c
  *
@@ -6,5 +13,30 @@ struct data_item {
 	size_t qid;
 	unsigned long long time;
 	char* msg;
+
+	// ns timestamps (ktime_get_ns) of creation, enqueue and dequeue
+	unsigned long long create_ns;
+	unsigned long long enq_ns;
+	unsigned long long deq_ns;
+
+	// latency slot of the producer in the fifo, -1 if none
+	int producer;
+
+	// priority level, higher ones are read first, see fifo_init_prio
+	unsigned int prio;
+
+	// channel for get_filtered, see fifo_init_tagged
+	unsigned int tag;
+
+	// discarded by fifo_read this long after enqueue, 0 for the ttl of the fifo
+	unsigned long long ttl_ns;
+
+	// one per holder, free_di drops one; in publish/subscribe mode the
+	// fifo and every consumer group that read the item hold one
+	struct kref ref;
+
+	// callback of put_async, 0 once it has been scheduled
+	struct fifo_ack* ack;
 };
 
+#endif
@@ -1,5 +1,12 @@
 #include "fifo.h"
 
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/module.h>		// pins the module of an ack callback
+
+#define CREATE_TRACE_POINTS
+#include "fifo_trace.h"
+
 struct data_item;
 struct fifo_dev;
 
@@ -11,21 +18,24 @@ struct fifo_dev;
  *				therefore changes for the caller, too.
  * 
  * @str: the string specifying the data_item contents.
- *		 has to be of the right format: "0,[creation time],[a message]"
+ *		 has to be of the right format: "[priority],[creation time],[a message]"
+ *		 where priority is 0 for the lowest level
  *
  * returns:
- *	ERR_PTR() if the creation time could not be parsed (from kstrtoull)
+ *	ERR_PTR() if priority or creation time could not be parsed (from kstrto*)
  * 	a pointer to the created struct
  */
 struct data_item* alloc_di_str(char* str)
 {
 	int err;
+	unsigned int prio;
 	unsigned long long time;
+	struct data_item* item;
 
 	char* sub_str_begin = str;
 	char* sub_str = str;
 
-	// ignore everything until the first ','
+	// get the priority
 	strsep(&sub_str, ","); 		// sub_str points right after the first ',' 
 	if (0 == sub_str)
 	{
@@ -33,6 +43,13 @@ struct data_item* alloc_di_str(char* str)
 		return ERR_PTR(-EINVAL);
 	}
 
+	err = kstrtouint(sub_str_begin, 0, &prio);
+	if (err)
+	{
+		printk(KERN_INFO "--- could not get priority for data_item, string was: %s\n", sub_str_begin);
+		return ERR_PTR(err);
+	}
+
 	// get the creation time, let strsep create the needed zero termination
 	sub_str_begin = sub_str;
 	strsep(&sub_str, ",");		// sub_str points right after the second ','
@@ -46,10 +63,13 @@ struct data_item* alloc_di_str(char* str)
 	if (err)
 	{
 		printk(KERN_INFO "--- could not get time for data_item, string was: %s\n", sub_str_begin);
-		return ERR_PTR(-err);
+		return ERR_PTR(err);
 	}
 
-	return alloc_di(sub_str, time);
+	item = alloc_di(sub_str, time);
+	if (!IS_ERR(item))
+		item->prio = prio;
+	return item;
 }
 
 /**
@@ -61,6 +81,8 @@ struct data_item* alloc_di_str(char* str)
  * @time: creation time of the struct or 0 to get the time during execution 
  *
  * returns:
+ *	ERR_PTR(-EINVAL) if msg is a null pointer
+ *	ERR_PTR(-ENOMEM) if memory could not be allocated
  * 	a pointer to the created struct
  */
 struct data_item* alloc_di(const char* msg, unsigned long long time)
@@ -75,11 +97,27 @@ struct data_item* alloc_di(const char* msg, unsigned long long time)
 	
 	// allocate memory
 	item = kmalloc(sizeof(struct data_item), GFP_KERNEL);
+	if (0 == item)
+		return ERR_PTR(-ENOMEM);
 
 	item->qid = 0;
-
-	// store the message
-	item->msg = kmalloc(strlen(msg) * sizeof(char), GFP_KERNEL);
+	item->create_ns = ktime_get_ns();
+	item->enq_ns = 0;
+	item->deq_ns = 0;
+	item->producer = -1;
+	item->prio = 0;
+	item->tag = 0;
+	item->ttl_ns = 0;
+	kref_init(&item->ref);
+	item->ack = 0;
+
+	// store the message, including its zero termination
+	item->msg = kmalloc((strlen(msg) + 1) * sizeof(char), GFP_KERNEL);
+	if (0 == item->msg)
+	{
+		kfree(item);
+		return ERR_PTR(-ENOMEM);
+	}
 	strcpy(item->msg, msg);
 
 	// store the time
@@ -96,359 +134,2516 @@ struct data_item* alloc_di(const char* msg, unsigned long long time)
 }
 EXPORT_SYMBOL(alloc_di);
 
+/*
+ * Free a callback and let its module go
+ */
+static void fifo_ack_free(struct fifo_ack* ack)
+{
+	if (0 == ack)
+		return;
+
+	module_put(ack->owner);
+	kfree(ack);
+}
+
+static void free_di_release(struct kref* ref)
+{
+	struct data_item* di = container_of(ref, struct data_item, ref);
+
+	// never reported, e.g. still queued at fifo_destroy
+	fifo_ack_free(di->ack);
+
+	if (di->msg != 0)
+		kfree(di->msg);
+	else
+		printk(KERN_INFO "free_di failed: null ptr msg\n");
+
+	kfree(di);
+}
+
 /**
- * Free the memory allocated to a data_item struct
+ * Free the memory allocated to a data_item struct,
+ * once every holder of the item has called this
  * 
  * @di: the data_item to deallocate
  */
 void free_di(struct data_item* di)
 {
 	if (di != 0)
-	{
-		if (di->msg != 0)
-			kfree(di->msg);
-		else
-			printk(KERN_INFO "free_di failed: null ptr msg\n");
-
-		kfree(di);
-	}
+		kref_put(&di->ref, free_di_release);
 	else
 		printk(KERN_INFO "free_di failed: null ptr data_item\n");
 }
 EXPORT_SYMBOL(free_di);
 
+// -------- acknowledgements ---------------------------------------------
 
-// -------- unblock ------------------------------------------------------
+static void fifo_ack_work(struct work_struct* work)
+{
+	struct fifo_ack* ack = container_of(work, struct fifo_ack, work);
 
-/*
- * Kill a specific, currently blocking reader.
- * Does nothing if devs buffer is not empty!
- * 
- * @dev: the device used by this function
- * @name: the lkm module name, yes the name obtainable from THIS_MODULE!
+	ack->fn(ack->ctx, ack->qid, ack->status);
+	fifo_ack_free(ack);
+}
+
+/**
+ * Let fn(ctx, qid, status) run in workqueue context once the item has
+ * been taken by a reader or dropped, see fifo_ack_fn. In
+ * publish/subscribe mode once every consumer group read it.
+ * The callback is not run for items freed by fifo_destroy.
+ * The module of fn is pinned until the callback ran or the item was
+ * freed, so it can not be unloaded while its callbacks are due.
+ *
+ * @item: an item not queued yet
+ * @fn: the callback, 0 to remove a callback set before
  *
  * returns:
- *	ENODEV if dev is a null pointer
- *	ERESTARTSYS if waiting for a lock was interrupted
- * 	0 on success, or dev.buffer not empty
+ *	0 on success
+ *	ENOMEM if the callback could not be allocated
+ *	ENODEV if the module of fn is being unloaded
  */
-int fifo_request_kill_read(struct fifo_dev* dev, const char* name)
+int fifo_set_ack(struct data_item* item, fifo_ack_fn fn, void* ctx)
 {
-	int ref_count;
-	int ret = 0;
+	struct fifo_ack* ack;
+	struct module* owner;
 
-	if (0 == dev)
-	{
-		printk(KERN_INFO "--- kill failed: null ptr device!\n");
-		return ENODEV;
-	}
+	fifo_ack_free(item->ack);
+	item->ack = 0;
 
-	//printk(KERN_INFO "--- %s: request_kill started!\n", name);
+	if (0 == fn)
+		return 0;
 
-	// block if write is in progress
-	if (mutex_lock_interruptible(&dev->write))
-		return ERESTARTSYS;
+	ack = kmalloc(sizeof(struct fifo_ack), GFP_KERNEL);
+	if (0 == ack)
+		return ENOMEM;
 
-	// block if read is in progress
-	if (mutex_lock_interruptible(&dev->read))
+	// the module list may only be walked with preemption off
+	preempt_disable();
+	owner = __module_address((unsigned long)fn);
+	if (owner && !try_module_get(owner))
 	{
-		mutex_unlock(&dev->write);
-		return ERESTARTSYS;
+		preempt_enable();
+		kfree(ack);
+		return ENODEV;
 	}
+	preempt_enable();
 
-	//printk(KERN_INFO "--- %s: request_kill acquired both mutexes!\n", name);
+	INIT_WORK(&ack->work, fifo_ack_work);
+	ack->fn = fn;
+	ack->owner = owner;
+	ack->ctx = ctx;
+	item->ack = ack;
+	return 0;
+}
 
-	// buffer not empty, return
-	if (dev->insertitions != dev->removals)
-	{
-		printk(KERN_INFO "--- %s: request_kill nothing to do!\n", name);
-		goto out;
-	}
+/*
+ * Schedule the callback of item, if it has one that did not run yet.
+ * Consumer groups may race here in publish/subscribe mode.
+ */
+static void fifo_ack(struct data_item* item, int status)
+{
+	struct fifo_ack* ack = xchg(&item->ack, 0);
 
-	ref_count = module_refcount(THIS_MODULE);
-	dev->mod_to_kill = name;
-	dev->kill = 1;
+	if (0 == ack)
+		return;
 
-	while (dev->kill && ref_count)
-	{
-		// allow one read
-		up(&dev->empty);
-		//printk(KERN_INFO "--- %s: request_kill up!\n", name);
+	ack->qid = item->qid;
+	ack->status = status;
+	schedule_work(&ack->work);
+}
 
-		// wait for fifo_read to do its thing
-		if (down_interruptible(&dev->wait_on_kill))
-		{
-			dev->kill = 0;
-			ret = ERESTARTSYS;
-			break;
-		}
-		--ref_count;
-	}
+/*
+ * item is handed to a reader of dev. Not for the shards, their gate
+ * reports it, nor in publish/subscribe mode, where the item is consumed
+ * once the last group read it.
+ */
+static struct data_item* fifo_consumed(struct fifo_dev* dev, struct data_item* item)
+{
+	if (!IS_ERR(item) && !dev->parent && !dev->pubsub)
+		fifo_ack(item, 0);
+	return item;
+}
 
-	//printk(KERN_INFO "--- %s: request_kill terminates, releases mutexes!\n", name);
+// -------- acknowledgements end -----------------------------------------
 
-out:
-	mutex_unlock(&dev->read);
-	mutex_unlock(&dev->write);
-	return ret;
+// -------- notification -------------------------------------------------
+
+static struct fifo_notifier* fifo_notify_find(struct fifo_dev* dev, const char* name)
+{
+	struct fifo_notifier* n;
+
+	list_for_each_entry(n, &dev->notifiers, node)
+		if (0 == strcmp(n->name, name))
+			return n;
+	return 0;
 }
 
-/*
- * Kill a specific, currently blocking writer.
- * Does nothing if devs buffer is not full!
- * 
- * @dev: the device used by this function
- * @name: the lkm module name, yes the name obtainable from THIS_MODULE!
+/**
+ * Register the consumer name to have fn(ctx) called once an item is
+ * written after it armed itself with fifo_notify_arm. fn runs in the
+ * context of the writer under a spinlock and must not sleep; it usually
+ * queues work that drains the fifo with fifo_read_nowait.
+ *
+ * @dev: the fifo device
+ * @name: the consumer, one notifier per name
  *
  * returns:
- *	ENODEV if dev is a null pointer
- *	ERESTARTSYS if waiting for a lock was interrupted
- * 	0 on success, or dev.buffer not full
+ *	0 on success, the notifier is not armed yet
+ *	EEXIST if name is registered already
+ *	ENOMEM
  */
-int fifo_request_kill_write(struct fifo_dev* dev, const char* name)
+int fifo_notify_add(struct fifo_dev* dev, const char* name, fifo_notify_fn fn, void* ctx)
 {
-	int ref_count;
-	int ret = 0;
-
-	if (0 == dev)
-	{
-		printk(KERN_INFO "--- kill failed: null ptr device!\n");
-		return ENODEV;
-	}
+	struct fifo_notifier* n = kzalloc(sizeof(struct fifo_notifier), GFP_KERNEL);
 
-	//printk(KERN_INFO "--- %s: request_kill started!\n", name);
+	if (0 == n)
+		return ENOMEM;
 
-	// block if write is in progress
-	if (mutex_lock_interruptible(&dev->write))
-		return ERESTARTSYS;
+	strlcpy(n->name, name, MODULE_NAME_LEN);
+	n->fn = fn;
+	n->ctx = ctx;
 
-	// block if read is in progress
-	if (mutex_lock_interruptible(&dev->read))
+	spin_lock(&dev->notify_lock);
+	if (fifo_notify_find(dev, n->name))
 	{
-		mutex_unlock(&dev->write);
-		return ERESTARTSYS;
+		spin_unlock(&dev->notify_lock);
+		kfree(n);
+		return EEXIST;
 	}
+	list_add_tail(&n->node, &dev->notifiers);
+	spin_unlock(&dev->notify_lock);
 
-	//printk(KERN_INFO "--- %s: request_kill acquired both mutexes!\n", name);
+	return 0;
+}
 
-	// buffer not full, return
-	if (dev->insertitions - dev->removals != dev->size)
-	{
-		printk(KERN_INFO "--- %s: request_kill nothing to do!\n", name);
-		goto out;
-	}
+/**
+ * Unregister the consumer name; its callback is not running and will
+ * not run anymore once this returns.
+ */
+void fifo_notify_del(struct fifo_dev* dev, const char* name)
+{
+	struct fifo_notifier* n;
 
-	ref_count = module_refcount(THIS_MODULE);
-	dev->mod_to_kill = name;
-	dev->kill = 1;
+	spin_lock(&dev->notify_lock);
+	n = fifo_notify_find(dev, name);
+	if (n)
+		list_del(&n->node);
+	spin_unlock(&dev->notify_lock);
 
-	while (dev->kill && ref_count)
-	{
-		// allow one write
-		up(&dev->full);
-		//printk(KERN_INFO "--- %s: request_kill up!\n", name);
+	kfree(n);
+}
 
-		// wait for fifo_write to do its thing
-		if (down_interruptible(&dev->wait_on_kill))
-		{
-			dev->kill = 0;
-			ret = ERESTARTSYS;
-			break;
-		}
-		--ref_count;
-	}
+/**
+ * Let the next write call the callback of name, once. A consumer arms
+ * after fifo_read_nowait found the fifo empty, then reads once more:
+ * an item written in between is either read or notified.
+ */
+void fifo_notify_arm(struct fifo_dev* dev, const char* name)
+{
+	struct fifo_notifier* n;
 
-	//printk(KERN_INFO "--- %s: request_kill terminates, releases mutexes!\n", name);
+	spin_lock(&dev->notify_lock);
+	n = fifo_notify_find(dev, name);
+	if (n)
+		WRITE_ONCE(n->armed, 1);
+	spin_unlock(&dev->notify_lock);
 
-out:
-	mutex_unlock(&dev->read);
-	mutex_unlock(&dev->write);
-	return ret;
+	// pairs with the barrier in fifo_notify
+	smp_mb();
 }
 
 /*
- * Check if a access to dev should be killed or requeued.
- * Note: interplays with kill request functions; signalling them
- * 		to do the next up(...) of their respective semaphores!
- * 
- * @dev: the device used by this function
- * @name: the lkm module name, yes the name obtainable from THIS_MODULE!
- *
- * returns:
- * 	0 as kill command
- *	-1 for requeueing
+ * An item has been made available to the readers of dev: call the
+ * armed notifiers
  */
-static int fifo_try_kill(struct fifo_dev* dev, const char* name)
+static void fifo_notify(struct fifo_dev* dev)
 {
-	int ret = -1;
-	
-	// user access; just queue the access again
-	if (0 == name)
-	{
-		//printk(KERN_INFO "--- fifo_try_kill: user, will not be killed!\n");
-		ret = -1;
-	}
-	// lkm access; kill it, if it is the right one ...
-	else if (0 == strcmp(name, dev->mod_to_kill))
-	{
-		dev->kill = 0;
-		ret = 0;
-		printk(KERN_INFO "--- %s: will be killed!\n", name);
-	}
+	struct fifo_notifier* n;
 
-	//printk(KERN_INFO "--- fifo_try_kill: '%s' and '%s' don't match!\n", name, dev->mod_to_kill);
+	if (list_empty(&dev->notifiers))
+		return;
 
-	up(&dev->wait_on_kill);
-	return ret;
+	// either the consumer sees the item or we see it armed
+	smp_mb();
+
+	spin_lock(&dev->notify_lock);
+	list_for_each_entry(n, &dev->notifiers, node)
+		if (xchg(&n->armed, 0))
+			n->fn(n->ctx);
+	spin_unlock(&dev->notify_lock);
 }
 
-// -------- unblock end --------------------------------------------------
+// -------- notification end ---------------------------------------------
 
-/** 
- * Read the first entry from the buffer.
- * This function may block!
- *
- * @dev: the fifo device
- * @name: 	name of the calling lkm (obtained from THIS_MODULE),
- * 			or 0 for user space.
- *
- * returns: 
- *	ptr to the read struct
- * 	ERR_PTR(ENODEV) if dev is a null pointer
- * 	ERR_PTR(EWOULDBLOCK) if calling lkm wants to unload
- *	ERR_PTR(EINTR) if mutex/semaphore locking was interrupted
+
+// -------- adaptive waiting ---------------------------------------------
+
+/*
+ * Fold the time since *last into the moving average *gap (weight 1/8).
+ * Racy updates from lockless callers only disturb the estimate.
  */
-struct data_item* fifo_read(struct fifo_dev* dev, const char* name)
+static void fifo_track_gap(u64 now, u64* last, u64* gap)
 {
-	struct data_item* item;
-
-	if (0 == dev)
-	{
-		printk(KERN_INFO "--- fifo_read failed: null ptr device!\n");
-		return ERR_PTR(-ENODEV);
-	}
+	if (*last)
+		*gap = *gap - (*gap >> 3) + ((now - *last) >> 3);
+	*last = now;
+}
 
-	// block if empty
-	if (down_interruptible(&dev->empty))
-		return ERR_PTR(-EINTR);
+/**
+ * Current occupancy of dev for tracing and watermarks, may be slightly
+ * off. A sharded device only knows it from its semaphore.
+ */
+size_t fifo_used(struct fifo_dev* dev)
+{
+	size_t size = READ_ONCE(dev->size);
 
-	if (dev->kill)
-	{
-		//printk(KERN_INFO "--- fifo_read: kill zone reached!\n");
-		if (0 == fifo_try_kill(dev, name))
-			return ERR_PTR(-EWOULDBLOCK);
-		else
-			return fifo_read(dev, name);
-	}
+	if (dev->shards)
+		return size - min_t(size_t, READ_ONCE(dev->full.count), size);
+	return READ_ONCE(dev->insertitions) - READ_ONCE(dev->removals);
+}
 
-	// block if another read is in progress
-	if (mutex_lock_interruptible(&dev->read))
-		return ERR_PTR(-EINTR);
+/**
+ * Whether a read of name would find an item, for poll. Unlocked, so it
+ * may be stale by the time the caller reads.
+ *
+ * @name: the reading lkm, or 0 for user space
+ */
+int fifo_readable(struct fifo_dev* dev, const char* name)
+{
+	int i;
+	const char* key = name ? name : FIFO_USER_NAME;
+	size_t insertitions = READ_ONCE(dev->insertitions);
 
-	// read from the queue
-	item = *(dev->buffer + dev->front);
-	dev->front = (dev->front +1) % dev->size;
-	up(&dev->full);
+	if (!READ_ONCE(dev->pubsub))
+		return READ_ONCE(dev->empty.count) > 0;
 
-	// update stats
-	++dev->removals;
+	// the items kept for slower groups do not count, a group that
+	// does not exist yet starts at the oldest item
+	for (i = 0; i < FIFO_MAX_GROUPS; ++i)
+		if (0 == strncmp(dev->groups[i].name, key, MODULE_NAME_LEN))
+			return READ_ONCE(dev->groups[i].next) != insertitions;
 
-	mutex_unlock(&dev->read);
-	return item;
+	return READ_ONCE(dev->removals) != insertitions;
 }
 
 /**
- * read the first entry from the buffer
- *
- * @dev: the fifo device
- * @item: the data_item ptr which will be written
- * @name: 	name of the calling lkm (obtained from THIS_MODULE),
- * 			or 0 for user space.
+ * Whether a write would find a free slot and, with a byte budget, some
+ * of it left, for poll. Unlocked like fifo_readable.
+ */
+int fifo_writable(struct fifo_dev* dev)
+{
+	size_t max_bytes = READ_ONCE(dev->max_bytes);
+
+	if (READ_ONCE(dev->full.count) <= 0)
+		return 0;
+
+	return 0 == max_bytes || atomic_long_read(&dev->bytes) < max_bytes;
+}
+
+/*
+ * Account a wait that started at start in the per-CPU stats of dev.
  *
- * returns: 
- *	0 on success
- * 	EWOULDBLOCK if calling lkm wants to unload
- *	ENODEV if dev is a null pointer
- *	EINTR if mutex/semaphore locking was interrupted
+ * @full: 1 for a wait on dev->full, 0 for dev->empty
+ * @spun: 1 if the wait ended while polling
  */
-int fifo_write(struct fifo_dev* dev, struct data_item* item, const char* name)
+static void fifo_wait_done(struct fifo_dev* dev, int full, u64 start, int spun)
 {
-	if (0 == dev)
-	{
-		printk(KERN_INFO "--- fifo_write failed: null ptr device!\n");
-		return ENODEV;
-	}
+	u64 waited = ktime_get_ns() - start;
+	struct fifo_pcpu_stats* pc = get_cpu_ptr(dev->pcpu);
+	struct fifo_wait_stats* ws = full ? &pc->full : &pc->empty;
 
-	// block if queue is full
-	if (down_interruptible(&dev->full))
-		return EINTR;
+	++ws->waits;
+	ws->spun += spun;
+	ws->total_ns += waited;
+	if (waited > ws->max_ns)
+		ws->max_ns = waited;
 
-	if (dev->kill)
-	{
-		//printk(KERN_INFO "--- fifo_write: kill zone reached!\n");
-		if (0 == fifo_try_kill(dev, name))
-			return EWOULDBLOCK;
-		else
-			return fifo_write(dev, item, name);
-	}
+	put_cpu_ptr(dev->pcpu);
+}
 
-	// block if another write is in progress
-	if (mutex_lock_interruptible(&dev->write))
-		return EINTR;
+/*
+ * A reader or writer sleeping in fifo_wait, lives on its stack.
+ * fifo_request_kill_read/_write find it by name and wake only it.
+ */
+struct fifo_waiter {
+	struct list_head node;
+	const char* name;
+	struct task_struct* task;
+	int killed;
+};
 
-	// prepare the data_item struct
-	item->qid = dev->seq_no;
+/*
+ * A kill request that found no sleeper of name. The next fifo_wait of
+ * name that would sleep takes and frees it, see fifo_kill_forget.
+ */
+struct fifo_kill_req {
+	struct list_head node;
+	char name[MODULE_NAME_LEN];
+	int write;
+};
 
-	// write to the queue
-	*(dev->buffer + dev->end) = item;
-	dev->end = (dev->end +1) % dev->size;
-	up(&dev->empty);
+/*
+ * The semaphores only count, their sleepers wait on these queues
+ */
+static wait_queue_head_t* fifo_sem_wait(struct fifo_dev* dev, struct semaphore* sem)
+{
+	return (sem == &dev->full) ? &dev->full_wait : &dev->empty_wait;
+}
 
-	// update stats
-	++dev->insertitions;
-	++dev->seq_no;
+/*
+ * up on dev->empty or dev->full, wakes one sleeper of fifo_wait
+ */
+static void fifo_up(struct fifo_dev* dev, struct semaphore* sem)
+{
+	wait_queue_head_t* wq = fifo_sem_wait(dev, sem);
 
-	mutex_unlock(&dev->write);
-	return 0;
+	up(sem);
+
+	// pairs with the barrier in prepare_to_wait
+	smp_mb();
+	if (waitqueue_active(wq))
+		wake_up_interruptible(wq);
 }
 
-/**
- * initializes the device, creates the buffer 
+/*
+ * Take a pending kill request for the sleeper name. Needs dev->wait_lock.
  *
- * @dev: the fifo device
- * @size: buffer size or 0 for default size (BUF_STDSIZE)
+ * @write: 1 for a writer, 0 for a reader
  *
- * returns: 
- *	EPERM if device has allready been used 
- * 	ENODEV if dev is a null pointer
- * 	0 on success
+ * returns:
+ *	1 if there was one, 0 otherwise
  */
-int fifo_init(struct fifo_dev* dev, size_t size)
+static int fifo_kill_take(struct fifo_dev* dev, const char* name, int write)
 {
-	if (0 == dev)
+	struct fifo_kill_req* k;
+
+	if (0 == name)
+		return 0;
+
+	list_for_each_entry(k, &dev->kills, node)
 	{
-		printk(KERN_INFO "--- fifo initialization failed: no device!\n");
-		return ENODEV;
+		if (k->write == write && 0 == strcmp(k->name, name))
+		{
+			list_del(&k->node);
+			kfree(k);
+			return 1;
+		}
 	}
+	return 0;
+}
 
-	if (dev->buffer != 0)
+/*
+ * Find the pending kill request of name. Needs dev->wait_lock.
+ */
+static struct fifo_kill_req* fifo_kill_find(struct fifo_dev* dev, const char* name, int write)
+{
+	struct fifo_kill_req* k;
+
+	list_for_each_entry(k, &dev->kills, node)
+		if (k->write == write && 0 == strcmp(k->name, name))
+			return k;
+	return 0;
+}
+
+/*
+ * A kill request for name, to be listed by fifo_kill_add.
+ * Allocated before the locks are taken.
+ *
+ * returns:
+ *	the request, 0 if no memory was left
+ */
+static struct fifo_kill_req* fifo_kill_new(const char* name, int write)
+{
+	struct fifo_kill_req* k = kmalloc(sizeof(*k), GFP_KERNEL);
+
+	if (0 == k)
+	{
+		printk(KERN_INFO "--- kill of %s can not be left pending: out of memory!\n", name);
+		return 0;
+	}
+
+	strlcpy(k->name, name, MODULE_NAME_LEN);
+	k->write = write;
+	return k;
+}
+
+/*
+ * List k, unless its name has a request already; one is enough.
+ * Needs dev->wait_lock.
+ *
+ * returns:
+ *	0 if k was listed, k otherwise, for kfree
+ */
+static struct fifo_kill_req* fifo_kill_add(struct fifo_dev* dev, struct fifo_kill_req* k)
+{
+	if (0 == k || fifo_kill_find(dev, k->name, k->write))
+		return k;
+
+	list_add_tail(&k->node, &dev->kills);
+	return 0;
+}
+
+/*
+ * Leave a kill request for name, unless it has one already.
+ * Takes dev->wait_lock.
+ *
+ * @write: 1 for a writer, 0 for a reader
+ */
+static void fifo_kill_pend(struct fifo_dev* dev, const char* name, int write)
+{
+	struct fifo_kill_req* k;
+
+	if (0 == name)
+		return;
+
+	k = fifo_kill_new(name, write);
+
+	spin_lock(&dev->wait_lock);
+	k = fifo_kill_add(dev, k);
+	spin_unlock(&dev->wait_lock);
+
+	kfree(k);
+}
+
+/*
+ * down_interruptible on sem, but if the counterpart usually shows up within
+ * the spin budget of dev, poll for it first instead of going to sleep.
+ * An idle queue has a large gap and sleeps right away.
+ * Sleepers are listed by name, so a kill request wakes only its target.
+ *
+ * @dev: the fifo device
+ * @sem: dev->empty or dev->full
+ * @gap: average time between ups of sem (insert_gap or remove_gap)
+ * @name: the caller, for tracing and kill requests
+ *
+ * returns:
+ *	0 if a count of sem was taken
+ *	-EWOULDBLOCK if name has to unload, see fifo_request_kill_read
+ *	-ERESTARTSYS if interrupted
+ */
+static int fifo_wait(struct fifo_dev* dev, struct semaphore* sem, u64 gap, const char* name)
+{
+	int full = (sem == &dev->full);
+	int got = 0;
+	int err;
+	u64 start, limit;
+	struct fifo_waiter w;
+	wait_queue_head_t* wq = fifo_sem_wait(dev, sem);
+
+	if (0 == down_trylock(sem))
+		return 0;
+
+	start = ktime_get_ns();
+
+	if (0 == dev->spin_ns || 0 == gap || gap > dev->spin_ns)
+		goto sleep;
+
+	limit = min(2 * gap, dev->spin_ns);
+
+	do
+	{
+		cpu_relax();
+
+		// only touch the semaphore lock if there is a chance
+		if (READ_ONCE(sem->count) > 0 && 0 == down_trylock(sem))
+		{
+			fifo_wait_done(dev, full, start, 1);
+			return 0;
+		}
+	} while (ktime_get_ns() - start < limit && !need_resched());
+
+sleep:
+	if (full)
+		trace_fifo_block_full(name, fifo_used(dev));
+	else
+		trace_fifo_block_empty(name, fifo_used(dev));
+
+	w.name = name;
+	w.task = current;
+	w.killed = 0;
+
+	spin_lock(&dev->wait_lock);
+	if (fifo_kill_take(dev, name, full))
+	{
+		spin_unlock(&dev->wait_lock);
+		trace_fifo_kill_complete(name);
+		return -EWOULDBLOCK;
+	}
+	list_add_tail(&w.node, full ? &dev->write_waiters : &dev->read_waiters);
+	spin_unlock(&dev->wait_lock);
+
+	// exclusive, an up wakes a single sleeper
+	err = wait_event_interruptible_exclusive(*wq,
+			(got = (0 == down_trylock(sem))) || READ_ONCE(w.killed));
+
+	spin_lock(&dev->wait_lock);
+	list_del(&w.node);
+	spin_unlock(&dev->wait_lock);
+
+	fifo_wait_done(dev, full, start, 0);
+
+	if (got)
+		return 0;
+
+	// we may have been woken for a count we did not take
+	if (READ_ONCE(sem->count) > 0)
+		wake_up_interruptible(wq);
+
+	if (err)
+		return err;
+
+	trace_fifo_kill_complete(name);
+	return -EWOULDBLOCK;
+}
+
+// -------- adaptive waiting end -----------------------------------------
+
+// -------- byte budget --------------------------------------------------
+
+/*
+ * A writer sleeping on dev->bytes_wait, lives on its stack.
+ * fifo_request_kill_write finds it by name and sets killed.
+ */
+struct fifo_bytes_waiter {
+	struct list_head node;
+	const char* name;
+	int killed;
+};
+
+/*
+ * Memory an item costs while queued: the struct and its message
+ */
+static size_t fifo_item_bytes(const struct data_item* item)
+{
+	return sizeof(*item) + strlen(item->msg) + 1;
+}
+
+/**
+ * Whether dev could ever take item, for callers that keep items
+ * elsewhere before they write them, like a spill file.
+ *
+ * returns:
+ *	0 if it could
+ *	EINVAL if dev is tagged and has no channel item->tag
+ *	EMSGSIZE if item alone is over the byte budget of dev
+ */
+int fifo_write_check(struct fifo_dev* dev, const struct data_item* item)
+{
+	if (dev->tagged && item->tag >= dev->nr_shards)
+		return EINVAL;
+
+	if (dev->max_bytes && fifo_item_bytes(item) > dev->max_bytes)
+		return EMSGSIZE;
+
+	return 0;
+}
+
+/*
+ * Reserve n bytes of the budget of dev, if they fit
+ *
+ * returns:
+ *	1 if reserved, 0 if over budget
+ */
+static int fifo_bytes_try(struct fifo_dev* dev, size_t n)
+{
+	long cur = atomic_long_read(&dev->bytes);
+	long old;
+
+	while (1)
+	{
+		if (cur + n > dev->max_bytes)
+			return 0;
+
+		old = atomic_long_cmpxchg(&dev->bytes, cur, cur + n);
+		if (old == cur)
+			return 1;
+		cur = old;
+	}
+}
+
+/*
+ * Reserve the bytes of item before it takes a slot, maybe wait for
+ * readers to free enough of them. Does nothing without a byte budget.
+ *
+ * @nowait: return EAGAIN instead of waiting
+ *
+ * returns:
+ *	0 if reserved
+ *	EMSGSIZE if the item alone exceeds the budget
+ *	EAGAIN if over budget and nowait is set
+ *	EINTR if waiting was interrupted
+ *	EWOULDBLOCK if name has to unload, see fifo_request_kill_write
+ */
+static int fifo_bytes_get(struct fifo_dev* dev, struct data_item* item, const char* name, int nowait)
+{
+	int got = 0;
+	int err = 0;
+	size_t n;
+	struct fifo_bytes_waiter w;
+
+	if (0 == dev->max_bytes)
+		return 0;
+
+	n = fifo_item_bytes(item);
+	if (n > dev->max_bytes)
+		return EMSGSIZE;
+
+	if (fifo_bytes_try(dev, n))
+		return 0;
+
+	if (nowait)
+		return EAGAIN;
+
+	w.name = name;
+	w.killed = 0;
+
+	// a kill that came before we were listed left a request, see
+	// fifo_bytes_kill
+	spin_lock(&dev->bytes_lock);
+	spin_lock(&dev->wait_lock);
+	w.killed = fifo_kill_take(dev, name, 1);
+	spin_unlock(&dev->wait_lock);
+	if (!w.killed)
+		list_add_tail(&w.node, &dev->bytes_waiters);
+	spin_unlock(&dev->bytes_lock);
+
+	if (w.killed)
+	{
+		trace_fifo_kill_complete(name);
+		return EWOULDBLOCK;
+	}
+
+	if (wait_event_interruptible(dev->bytes_wait,
+			(got = fifo_bytes_try(dev, n)) || READ_ONCE(w.killed)))
+		err = EINTR;
+	else if (!got)
+	{
+		err = EWOULDBLOCK;
+		trace_fifo_kill_complete(name);
+	}
+
+	spin_lock(&dev->bytes_lock);
+	list_del(&w.node);
+	spin_unlock(&dev->bytes_lock);
+
+	return err;
+}
+
+/*
+ * Give the bytes of item back, after it left the queue or failed to enter
+ */
+static void fifo_bytes_put(struct fifo_dev* dev, struct data_item* item)
+{
+	if (0 == dev->max_bytes)
+		return;
+
+	atomic_long_sub(fifo_item_bytes(item), &dev->bytes);
+
+	// pairs with the barrier in prepare_to_wait
+	smp_mb__after_atomic();
+	if (waitqueue_active(&dev->bytes_wait))
+		wake_up_interruptible(&dev->bytes_wait);
+}
+
+/*
+ * Unblock the writers of name waiting for bytes. If there is none, but
+ * the budget is used up, one may be about to wait: leave a kill request
+ * for it, under bytes_lock like its check in fifo_bytes_get.
+ *
+ * returns:
+ *	the number of writers unblocked
+ */
+static int fifo_bytes_kill(struct fifo_dev* dev, const char* name)
+{
+	int killed = 0;
+	struct fifo_bytes_waiter* w;
+	struct fifo_kill_req* k;
+
+	if (0 == dev->max_bytes || 0 == name)
+		return 0;
+
+	k = fifo_kill_new(name, 1);
+
+	spin_lock(&dev->bytes_lock);
+	list_for_each_entry(w, &dev->bytes_waiters, node)
+	{
+		if (w->name && 0 == strcmp(w->name, name))
+		{
+			WRITE_ONCE(w->killed, 1);
+			++killed;
+		}
+	}
+
+	if (0 == killed && atomic_long_read(&dev->bytes) >= dev->max_bytes)
+	{
+		spin_lock(&dev->wait_lock);
+		k = fifo_kill_add(dev, k);
+		spin_unlock(&dev->wait_lock);
+	}
+	spin_unlock(&dev->bytes_lock);
+
+	kfree(k);
+
+	if (killed)
+		wake_up_interruptible_all(&dev->bytes_wait);
+	return killed;
+}
+
+// -------- byte budget end ----------------------------------------------
+
+// -------- latency ------------------------------------------------------
+
+/*
+ * Count ns in the log2 histogram h.
+ * Bucket i holds values in [2^(i-1), 2^i), the last one everything above.
+ */
+static void fifo_hist_add(struct fifo_hist* h, u64 ns)
+{
+	unsigned int b = fls64(ns);
+
+	if (b >= FIFO_HIST_BUCKETS)
+		b = FIFO_HIST_BUCKETS - 1;
+
+	++h->bucket[b];
+	++h->count;
+	h->sum += ns;
+	if (ns > h->max)
+		h->max = ns;
+}
+
+/*
+ * Add all counts of from to to.
+ */
+static void fifo_hist_merge(struct fifo_hist* to, const struct fifo_hist* from)
+{
+	unsigned int i;
+
+	for (i = 0; i < FIFO_HIST_BUCKETS; ++i)
+		to->bucket[i] += from->bucket[i];
+
+	to->count += from->count;
+	to->sum += from->sum;
+	if (from->max > to->max)
+		to->max = from->max;
+}
+
+/*
+ * Find or add the latency slot of a producer. Slots are never freed,
+ * so lookups do not need the lock. Shards use the table of their
+ * sharded device, so a slot means the same producer in every shard.
+ *
+ * @dev: the fifo device
+ * @name: name of the producing lkm or 0 for user space
+ *
+ * returns:
+ *	index into producer_names, -1 if the table is full
+ */
+static int fifo_producer_slot(struct fifo_dev* dev, const char* name)
+{
+	int i, nr;
+	struct fifo_dev* owner = dev->parent ? dev->parent : dev;
+	const char* key = name ? name : FIFO_USER_NAME;
+
+	nr = smp_load_acquire(&owner->nr_producers);
+	for (i = 0; i < nr; ++i)
+		if (0 == strcmp(owner->producer_names[i], key))
+			return i;
+
+	spin_lock(&owner->producer_lock);
+
+	// someone may have added it meanwhile
+	for (i = 0; i < owner->nr_producers; ++i)
+		if (0 == strcmp(owner->producer_names[i], key))
+			goto out;
+
+	if (i == FIFO_MAX_PRODUCERS)
+	{
+		i = -1;
+		goto out;
+	}
+
+	strlcpy(owner->producer_names[i], key, MODULE_NAME_LEN);
+	smp_store_release(&owner->nr_producers, i + 1);
+
+out:
+	spin_unlock(&owner->producer_lock);
+	return i;
+}
+
+static void fifo_wait_merge(struct fifo_wait_stats* to, const struct fifo_wait_stats* from)
+{
+	to->waits += from->waits;
+	to->spun += from->spun;
+	to->total_ns += from->total_ns;
+	if (from->max_ns > to->max_ns)
+		to->max_ns = from->max_ns;
+}
+
+static void fifo_hold_merge(struct fifo_hold_stats* to, const struct fifo_hold_stats* from)
+{
+	to->count += from->count;
+	to->total_ns += from->total_ns;
+	if (from->max_ns > to->max_ns)
+		to->max_ns = from->max_ns;
+}
+
+/*
+ * Integral of the occupancy of dev over time, in item * ns.
+ * Every dequeued item contributed its queueing delay, every queued one
+ * the time since its enqueue. enq_in - enq_out is the sum of the enqueue
+ * times of the queued items; the sums may wrap, their difference does not.
+ */
+static u64 fifo_occupancy_area(struct fifo_dev* dev, u64 now)
+{
+	size_t used = dev->insertitions - dev->removals;
+
+	return dev->queue_delay.sum + dev->drop_delay + used * now - (dev->enq_in - dev->enq_out);
+}
+
+/*
+ * Add the item counters of dev to snap, see fifo_counters
+ */
+static void fifo_counters_add(struct fifo_dev* dev, struct fifo_snapshot* snap)
+{
+	size_t drops, removals, insertitions;
+
+	// drops first: every dropped item has been removed before
+	drops = READ_ONCE(dev->drops);
+	smp_rmb();
+
+	// removals first: every removed item has been inserted before
+	removals = READ_ONCE(dev->removals);
+	smp_rmb();
+	insertitions = READ_ONCE(dev->insertitions);
+
+	snap->insertitions += insertitions;
+	snap->removals += removals - drops;
+	snap->used += min(insertitions - removals, READ_ONCE(dev->slots));
+}
+
+/*
+ * Add the counters of dev to snap, see fifo_snapshot
+ */
+static void fifo_snapshot_add(struct fifo_dev* dev, struct fifo_snapshot* snap, u64 now)
+{
+	int cpu;
+
+	fifo_counters_add(dev, snap);
+
+	for_each_possible_cpu(cpu)
+	{
+		struct fifo_pcpu_stats* pc = per_cpu_ptr(dev->pcpu, cpu);
+
+		fifo_wait_merge(&snap->full, &pc->full);
+		fifo_wait_merge(&snap->empty, &pc->empty);
+		snap->rejected += pc->rejected;
+		snap->dropped += pc->dropped;
+		snap->expired += pc->expired;
+	}
+
+	fifo_hold_merge(&snap->write, &dev->write_hold);
+	fifo_hold_merge(&snap->read, &dev->read_hold);
+
+	snap->peak += READ_ONCE(dev->peak);
+	snap->area += fifo_occupancy_area(dev, now);
+}
+
+/**
+ * Only size, used, insertitions and removals of fifo_snapshot, summed over
+ * the shards. Cheap enough for interrupt context; the other fields of snap
+ * are left 0.
+ *
+ * @dev: the fifo device
+ * @snap: filled in
+ */
+void fifo_counters(struct fifo_dev* dev, struct fifo_snapshot* snap)
+{
+	unsigned int i;
+
+	memset(snap, 0, sizeof(*snap));
+
+	snap->size = READ_ONCE(dev->size);
+	fifo_counters_add(dev, snap);
+
+	if (0 == dev->shards)
+		return;
+
+	for (i = 0; i < dev->nr_shards; ++i)
+		fifo_counters_add(dev->shards + i, snap);
+
+	snap->used = min(snap->used, snap->size);
+}
+
+/**
+ * Counters, blocking, lock and occupancy stats of dev and, if sharded,
+ * of its shards. Nothing is locked and the data path is not disturbed;
+ * every counter has a single writer or is per-CPU. Removals are read
+ * before insertitions, so used never drops below 0 or exceeds size.
+ * The wait and hold stats are read while they change, the count, sum
+ * and max of one of them may be off by the update in progress.
+ *
+ * @dev: the fifo device
+ * @snap: filled in
+ */
+void fifo_snapshot(struct fifo_dev* dev, struct fifo_snapshot* snap)
+{
+	unsigned int i;
+	u64 now = ktime_get_ns();
+
+	memset(snap, 0, sizeof(*snap));
+
+	snap->size = READ_ONCE(dev->size);
+	snap->elapsed_ns = now - dev->created;
+	snap->max_bytes = dev->max_bytes;
+	snap->bytes = atomic_long_read(&dev->bytes);
+
+	// a sharded device itself only counts waits on its semaphores
+	fifo_snapshot_add(dev, snap, now);
+
+	if (dev->pubsub)
+	{
+		// next is read after insertitions, so the lag never wraps
+		for (i = 0; i < FIFO_MAX_GROUPS; ++i)
+			if (READ_ONCE(dev->groups[i].name[0]))
+				snap->max_lag = max(snap->max_lag,
+					snap->insertitions - min(READ_ONCE(dev->groups[i].next), snap->insertitions));
+	}
+
+	if (0 == dev->shards)
+	{
+		snap->seq_no = READ_ONCE(dev->seq_no);
+		return;
+	}
+
+	snap->seq_no = atomic64_read(&dev->shard_seq);
+
+	// the peaks of the shards may not have been reached at the same time
+	for (i = 0; i < dev->nr_shards; ++i)
+		fifo_snapshot_add(dev->shards + i, snap, now);
+
+	snap->used = min(snap->used, snap->size);
+	snap->peak = min(snap->peak, snap->size);
+}
+
+/**
+ * Sum up the latency histograms of dev and, if sharded, of its shards.
+ * Read without locking.
+ *
+ * @dev: the fifo device
+ * @queue: filled in with the enqueue to dequeue delays
+ * @producers: FIFO_MAX_PRODUCERS histograms, filled in with the creation to
+ *		dequeue latency per producer, named by dev->producer_names
+ */
+void fifo_latency(struct fifo_dev* dev, struct fifo_hist* queue, struct fifo_hist* producers)
+{
+	unsigned int i, p;
+
+	memset(queue, 0, sizeof(*queue));
+	memset(producers, 0, FIFO_MAX_PRODUCERS * sizeof(*producers));
+
+	fifo_hist_merge(queue, &dev->queue_delay);
+	for (p = 0; p < FIFO_MAX_PRODUCERS; ++p)
+		fifo_hist_merge(producers + p, dev->producer_lat + p);
+
+	// the shards keep no producer latencies of their own
+	for (i = 0; i < dev->nr_shards; ++i)
+		fifo_hist_merge(queue, &dev->shards[i].queue_delay);
+}
+
+// -------- latency end --------------------------------------------------
+
+// -------- buffer access ------------------------------------------------
+
+/*
+ * Append item at dev->end and hand out its qid.
+ * Needs dev->write and one count of dev->full.
+ *
+ * @name: name of the producing lkm or 0 for user space
+ */
+static void fifo_insert(struct fifo_dev* dev, struct data_item* item, const char* name)
+{
+	size_t used;
+	u64 now = ktime_get_ns();
+
+	// prepare the data_item struct
+	if (dev->parent)
+		item->qid = atomic64_inc_return(&dev->parent->shard_seq) - 1;
+	else
+		item->qid = dev->seq_no;
+	item->enq_ns = now;
+	item->producer = fifo_producer_slot(dev, name);
+
+	// write to the queue
+	*(dev->buffer + dev->end) = item;
+	dev->end = (dev->end +1) % dev->slots;
+
+	// the gate counts a shard item before a channel reader can take
+	// it, see fifo_read_tag
+	if (dev->parent)
+		fifo_up(dev->parent, &dev->parent->empty);
+	fifo_up(dev, &dev->empty);
+
+	// update stats, consumer groups read the item once they see this
+	smp_store_release(&dev->insertitions, dev->insertitions + 1);
+	++dev->seq_no;
+	fifo_track_gap(now, &dev->last_insert, &dev->insert_gap);
+
+	// removals may be stale, so this can overshoot by concurrent reads
+	used = min(dev->insertitions - READ_ONCE(dev->removals), dev->slots);
+	if (used > dev->peak)
+		dev->peak = used;
+	dev->enq_in += now;
+
+	trace_fifo_enqueue(item, name, used);
+
+	// a shard is only readable once its gate counted the item
+	if (0 == dev->parent)
+		fifo_notify(dev);
+}
+
+/*
+ * Remove the item at dev->front.
+ * Needs dev->read and one count of dev->empty.
+ *
+ * @name: name of the consuming lkm or 0 for user space
+ * @drop: 1 if the item is dropped, it is left out of the consumer stats
+ */
+static struct data_item* fifo_remove(struct fifo_dev* dev, const char* name, int drop)
+{
+	u64 now = ktime_get_ns();
+	struct data_item* item;
+
+	// read from the queue
+	item = *(dev->buffer + dev->front);
+	dev->front = (dev->front +1) % dev->slots;
+
+	// a pending shrink keeps the freed slot
+	if (dev->shrink_pending)
+		--dev->shrink_pending;
+	else
+		fifo_up(dev, &dev->full);
+
+	item->deq_ns = now;
+	fifo_bytes_put(dev, item);
+
+	// removals counts positions, drops takes the dropped ones out again
+	++dev->removals;
+	dev->enq_out += item->enq_ns;
+
+	if (drop)
+	{
+		dev->drop_delay += now - item->enq_ns;
+
+		// see fifo_snapshot_add
+		smp_wmb();
+		WRITE_ONCE(dev->drops, dev->drops + 1);
+		return item;
+	}
+
+	// update stats
+	fifo_track_gap(now, &dev->last_remove, &dev->remove_gap);
+
+	fifo_hist_add(&dev->queue_delay, now - item->enq_ns);
+	if (item->producer >= 0 && dev->parent)
+	{
+		spin_lock(&dev->parent->lat_lock);
+		fifo_hist_add(dev->parent->producer_lat + item->producer, now - item->create_ns);
+		spin_unlock(&dev->parent->lat_lock);
+	}
+	else if (item->producer >= 0)
+		fifo_hist_add(dev->producer_lat + item->producer, now - item->create_ns);
+
+	// reading insertitions pulls in the producers cacheline, only if needed
+	if (trace_fifo_dequeue_enabled())
+		trace_fifo_dequeue(item, name, fifo_used(dev));
+
+	return item;
+}
+
+// -------- buffer access end --------------------------------------------
+
+// -------- lock accounting ----------------------------------------------
+
+/*
+ * The holder of a mutex notes when it got it and, before unlocking,
+ * how long it kept it. Only the holder writes these stats.
+ */
+static void fifo_hold_begin(struct fifo_hold_stats* hs)
+{
+	hs->since = ktime_get_ns();
+}
+
+static void fifo_hold_end(struct fifo_hold_stats* hs)
+{
+	u64 held = ktime_get_ns() - hs->since;
+
+	++hs->count;
+	hs->total_ns += held;
+	if (held > hs->max_ns)
+		hs->max_ns = held;
+}
+
+/*
+ * Lock dev->write, see mutex_lock_interruptible
+ */
+static int fifo_write_lock(struct fifo_dev* dev)
+{
+	if (mutex_lock_interruptible(&dev->write))
+		return -EINTR;
+
+	fifo_hold_begin(&dev->write_hold);
+	return 0;
+}
+
+/*
+ * Lock dev->write if it is free, see mutex_trylock
+ */
+static int fifo_write_trylock(struct fifo_dev* dev)
+{
+	if (!mutex_trylock(&dev->write))
+		return 0;
+
+	fifo_hold_begin(&dev->write_hold);
+	return 1;
+}
+
+/*
+ * Lock dev->read, see mutex_lock_interruptible
+ */
+static int fifo_read_lock(struct fifo_dev* dev)
+{
+	if (mutex_lock_interruptible(&dev->read))
+		return -EINTR;
+
+	fifo_hold_begin(&dev->read_hold);
+	return 0;
+}
+
+/*
+ * Lock dev->read if it is free, see mutex_trylock
+ */
+static int fifo_read_trylock(struct fifo_dev* dev)
+{
+	if (!mutex_trylock(&dev->read))
+		return 0;
+
+	fifo_hold_begin(&dev->read_hold);
+	return 1;
+}
+
+static void fifo_read_unlock(struct fifo_dev* dev)
+{
+	fifo_hold_end(&dev->read_hold);
+	mutex_unlock(&dev->read);
+}
+
+// -------- lock accounting end ------------------------------------------
+
+// -------- combining write path ----------------------------------------
+
+/*
+ * A pending write published by a producer in combining mode.
+ * Lives on the producers stack until done is completed.
+ */
+struct fifo_write_req {
+	struct llist_node node;
+	struct data_item* item;
+	const char* name;
+	struct completion done;
+};
+
+/*
+ * Apply all published writes in one pass, in the order they were published.
+ * Each of them already holds one count of dev->full.
+ * Needs dev->write to be held.
+ */
+static void fifo_combine(struct fifo_dev* dev)
+{
+	struct llist_node* list;
+	struct fifo_write_req* req;
+	struct fifo_write_req* tmp;
+
+	list = llist_del_all(&dev->write_reqs);
+	if (0 == list)
+		return;
+
+	list = llist_reverse_order(list);
+	llist_for_each_entry_safe(req, tmp, list, node)
+	{
+		fifo_insert(dev, req->item, req->name);
+
+		// req may be gone right after this
+		complete(&req->done);
+	}
+
+	wake_up_interruptible(&dev->poll_wait);
+}
+
+/*
+ * Release dev->write. In combining mode, requests published while the
+ * mutex was held are applied here; their producers only wait for us.
+ */
+static void fifo_write_unlock(struct fifo_dev* dev)
+{
+	while (1)
+	{
+		fifo_hold_end(&dev->write_hold);
+		mutex_unlock(&dev->write);
+
+		// pairs with llist_add in fifo_combine_put: either we see the
+		// request or its producer sees the mutex unlocked
+		smp_mb();
+
+		if (!dev->combine || llist_empty(&dev->write_reqs))
+			return;
+
+		// someone else holds it and will recheck after unlocking
+		if (!fifo_write_trylock(dev))
+			return;
+
+		fifo_combine(dev);
+	}
+}
+
+/*
+ * Publish item and either combine all pending writes or wait for the
+ * current holder of dev->write to do it.
+ * The caller already holds one count of dev->full.
+ *
+ * returns:
+ *	0, the item is always written
+ */
+static int fifo_combine_put(struct fifo_dev* dev, struct data_item* item, const char* name)
+{
+	struct fifo_write_req req;
+
+	req.item = item;
+	req.name = name;
+	init_completion(&req.done);
+
+	llist_add(&req.node, &dev->write_reqs);
+
+	if (fifo_write_trylock(dev))
+	{
+		fifo_combine(dev);
+		fifo_write_unlock(dev);
+	}
+
+	wait_for_completion(&req.done);
+	return 0;
+}
+
+// -------- combining write path end ------------------------------------
+
+// -------- publish/subscribe --------------------------------------------
+
+/*
+ * Find the consumer group name of dev, maybe add it. A new group starts
+ * at the oldest item the fifo still holds. Needs dev->read.
+ *
+ * @name: the group, 0 for user space
+ * @add: 1 to add the group if it does not exist
+ *
+ * returns:
+ *	the group, 0 if not found or FIFO_MAX_GROUPS groups exist
+ */
+static struct fifo_group* fifo_group_find(struct fifo_dev* dev, const char* name, int add)
+{
+	int i;
+	struct fifo_group* g;
+	struct fifo_group* unused = 0;
+	const char* key = name ? name : FIFO_USER_NAME;
+
+	for (i = 0; i < FIFO_MAX_GROUPS; ++i)
+	{
+		g = dev->groups + i;
+
+		if (0 == g->name[0])
+		{
+			if (0 == unused)
+				unused = g;
+		}
+		else if (0 == strcmp(g->name, key))
+			return g;
+	}
+
+	if (!add || 0 == unused)
+		return 0;
+
+	memset(unused, 0, sizeof(*unused));
+	unused->next = dev->removals;
+	strlcpy(unused->name, key, MODULE_NAME_LEN);
+	return unused;
+}
+
+/*
+ * Remove the items every group has read: the fifo drops its reference
+ * and frees their slots. With no group left the items are kept.
+ * Needs dev->read.
+ */
+static void fifo_group_release(struct fifo_dev* dev, const char* name)
+{
+	int i;
+	int any = 0;
+	size_t n;
+	size_t read = SIZE_MAX;
+	struct data_item* item;
+
+	// number of items read by the slowest group
+	for (i = 0; i < FIFO_MAX_GROUPS; ++i)
+	{
+		if (0 == dev->groups[i].name[0])
+			continue;
+
+		any = 1;
+		read = min(read, dev->groups[i].next - dev->removals);
+	}
+
+	if (!any)
+		return;
+
+	// every queued item holds a count of empty
+	for (n = 0; n < read && 0 == down_trylock(&dev->empty); ++n)
+	{
+		item = fifo_remove(dev, name, 0);
+		fifo_ack(item, 0);
+		free_di(item);
+	}
+
+	// wake pollers waiting for free space
+	if (n)
+		wake_up_interruptible(&dev->poll_wait);
+}
+
+/*
+ * Leave the group name; its sleeping readers return ERR_PTR(-EWOULDBLOCK)
+ * and the last of them removes it. Without sleepers the next read of
+ * name returns it instead, see fifo_kill_pend. Needs dev->read.
+ *
+ * returns:
+ *	1 if there was such a group, 0 otherwise
+ */
+static int fifo_group_leave(struct fifo_dev* dev, const char* name)
+{
+	struct fifo_group* g = fifo_group_find(dev, name, 0);
+
+	if (g && g->waiters)
+	{
+		WRITE_ONCE(g->kill, 1);
+		wake_up_interruptible_all(&dev->poll_wait);
+		return 1;
+	}
+
+	// a reader of name may be on its way, it must not add the group anew
+	fifo_kill_pend(dev, name, 0);
+
+	if (0 == g)
+		return 0;
+
+	WRITE_ONCE(g->name[0], 0);
+	fifo_group_release(dev, name);
+	return 1;
+}
+
+/*
+ * Read the next item of the group name, see fifo_set_pubsub.
+ * The caller gets its own reference to the item.
+ *
+ * @nowait: return ERR_PTR(-EAGAIN) instead of waiting
+ *
+ * returns:
+ *	see fifo_read
+ *	ERR_PTR(-ENOSPC) if the group would be one too many
+ */
+static struct data_item* fifo_group_read(struct fifo_dev* dev, const char* name, int nowait)
+{
+	int err;
+	struct fifo_group* g;
+	struct data_item* item;
+
+	if (nowait && !fifo_read_trylock(dev))
+		return ERR_PTR(-EAGAIN);
+	else if (!nowait && fifo_read_lock(dev))
+		return ERR_PTR(-EINTR);
+
+	// the group was left before we got here, see fifo_group_leave
+	spin_lock(&dev->wait_lock);
+	err = fifo_kill_take(dev, name, 0);
+	spin_unlock(&dev->wait_lock);
+	if (err)
+	{
+		trace_fifo_kill_complete(name);
+		item = ERR_PTR(-EWOULDBLOCK);
+		goto out;
+	}
+
+	g = fifo_group_find(dev, name, 1);
+	if (0 == g)
+	{
+		item = ERR_PTR(-ENOSPC);
+		goto out;
+	}
+
+	while (g->next == smp_load_acquire(&dev->insertitions))
+	{
+		if (nowait)
+		{
+			item = ERR_PTR(-EAGAIN);
+			goto out;
+		}
+
+		++g->waiters;
+		fifo_read_unlock(dev);
+
+		trace_fifo_block_empty(name, fifo_used(dev));
+		err = wait_event_interruptible(dev->poll_wait,
+				READ_ONCE(g->next) != READ_ONCE(dev->insertitions) || READ_ONCE(g->kill));
+
+		// waiters has to be decremented, do not get interrupted
+		mutex_lock(&dev->read);
+		fifo_hold_begin(&dev->read_hold);
+		--g->waiters;
+
+		if (g->kill)
+		{
+			// the last one out removes the group
+			if (0 == g->waiters)
+			{
+				WRITE_ONCE(g->name[0], 0);
+				fifo_group_release(dev, name);
+			}
+
+			trace_fifo_kill_complete(name);
+			item = ERR_PTR(-EWOULDBLOCK);
+			goto out;
+		}
+
+		if (err)
+		{
+			item = ERR_PTR(-EINTR);
+			goto out;
+		}
+	}
+
+	item = dev->buffer[(dev->front + (g->next - dev->removals)) % dev->slots];
+	kref_get(&item->ref);
+	item->deq_ns = ktime_get_ns();
+
+	++g->next;
+	++g->consumed;
+
+	fifo_group_release(dev, name);
+
+out:
+	fifo_read_unlock(dev);
+	return item;
+}
+
+/*
+ * Free the oldest item for FIFO_DROP_OLDEST, the groups that have not
+ * read it yet skip it.
+ *
+ * returns:
+ *	see fifo_drop_oldest
+ */
+static int fifo_group_drop_oldest(struct fifo_dev* dev, const char* name)
+{
+	int i;
+	struct data_item* item;
+
+	if (fifo_read_lock(dev))
+		return EINTR;
+
+	if (dev->removals == READ_ONCE(dev->insertitions) || down_trylock(&dev->empty))
+	{
+		fifo_read_unlock(dev);
+		return EAGAIN;
+	}
+
+	for (i = 0; i < FIFO_MAX_GROUPS; ++i)
+		if (dev->groups[i].name[0] && dev->groups[i].next == dev->removals)
+			++dev->groups[i].next;
+
+	item = fifo_remove(dev, name, 1);
+	fifo_ack(item, ECANCELED);
+	free_di(item);
+
+	fifo_read_unlock(dev);
+	return 0;
+}
+
+// -------- publish/subscribe end ----------------------------------------
+
+// -------- unblock ------------------------------------------------------
+
+/*
+ * Pending kill requests are only left on an empty (readers) or full
+ * (writers) device.
+ * A sharded device does not keep insertitions and removals itself,
+ * but a waiter blocked on one of its semaphores keeps the count at 0.
+ */
+static int fifo_is_empty(struct fifo_dev* dev)
+{
+	if (dev->shards)
+		return 0 == READ_ONCE(dev->empty.count);
+	return dev->insertitions == dev->removals;
+}
+
+static int fifo_is_full(struct fifo_dev* dev)
+{
+	if (dev->shards)
+		return 0 == READ_ONCE(dev->full.count);
+	return dev->insertitions - dev->removals >= dev->size;
+}
+
+/*
+ * Wake the sleepers of name in fifo_wait. If there is none, but the
+ * device is empty (full), one may be about to sleep: leave a kill
+ * request for it. It stays until name takes it or goes away.
+ * Nobody else is woken and the mutexes are not touched.
+ *
+ * @write: 1 for writers, 0 for readers
+ * @pending: 0 to only wake sleepers
+ *
+ * returns:
+ *	the number of waiters unblocked
+ */
+static int fifo_kill(struct fifo_dev* dev, const char* name, int write, int pending)
+{
+	int woken = 0;
+	struct fifo_waiter* w;
+	struct fifo_kill_req* k = 0;
+
+	if (0 == name)
+		return 0;
+
+	// allocated up front, the check for a sleeper is under the lock
+	if (pending)
+		k = fifo_kill_new(name, write);
+
+	spin_lock(&dev->wait_lock);
+
+	list_for_each_entry(w, write ? &dev->write_waiters : &dev->read_waiters, node)
+	{
+		if (w->name && 0 == strcmp(w->name, name))
+		{
+			WRITE_ONCE(w->killed, 1);
+			wake_up_process(w->task);
+			++woken;
+		}
+	}
+
+	if (0 == woken && (write ? fifo_is_full(dev) : fifo_is_empty(dev)))
+		k = fifo_kill_add(dev, k);
+
+	spin_unlock(&dev->wait_lock);
+	kfree(k);
+	return woken;
+}
+
+/**
+ * Drop the kill requests name left pending on dev and its shards,
+ * once name is gone and will not take them any more.
+ *
+ * @dev: the fifo device
+ * @name: the lkm module name, 0 for all requests
+ */
+void fifo_kill_forget(struct fifo_dev* dev, const char* name)
+{
+	unsigned int i;
+	struct fifo_kill_req* k;
+	struct fifo_kill_req* tmp;
+
+	spin_lock(&dev->wait_lock);
+	list_for_each_entry_safe(k, tmp, &dev->kills, node)
+	{
+		if (0 == name || 0 == strcmp(k->name, name))
+		{
+			list_del(&k->node);
+			kfree(k);
+		}
+	}
+	spin_unlock(&dev->wait_lock);
+
+	for (i = 0; dev->shards && i < dev->nr_shards; ++i)
+		fifo_kill_forget(dev->shards + i, name);
+}
+
+/*
+ * Kill a specific, currently blocking reader.
+ * Does nothing if devs buffer is not empty and no reader of name sleeps!
+ * The readers of fifo_read_tag are woken as well.
+ * 
+ * @dev: the device used by this function
+ * @name: the lkm module name, yes the name obtainable from THIS_MODULE!
+ *
+ * returns:
+ *	ENODEV if dev is a null pointer
+ *	ERESTARTSYS if waiting for a lock was interrupted
+ * 	0 on success, or nothing to do
+ */
+int fifo_request_kill_read(struct fifo_dev* dev, const char* name)
+{
+	unsigned int i;
+	int act = 0;
+
+	if (0 == dev)
+	{
+		printk(KERN_INFO "--- kill failed: null ptr device!\n");
+		return ENODEV;
+	}
+
+	// consumer groups do not wait on empty, the group of name is left
+	if (dev->pubsub)
+	{
+		if (fifo_read_lock(dev))
+			return ERESTARTSYS;
+
+		trace_fifo_kill_request(name, 0, fifo_group_leave(dev, name));
+		fifo_read_unlock(dev);
+		return 0;
+	}
+
+	// filtered readers sleep on their channel
+	for (i = 0; dev->tagged && i < dev->nr_shards; ++i)
+		act += fifo_kill(dev->shards + i, name, 0, fifo_is_empty(dev->shards + i));
+
+	act += fifo_kill(dev, name, 0, !act);
+
+	trace_fifo_kill_request(name, 0, act);
+	return 0;
+}
+
+/*
+ * Kill a specific, currently blocking writer.
+ * Does nothing if devs buffer is not full and no writer of name sleeps,
+ * unless the writer waits for the byte budget!
+ * 
+ * @dev: the device used by this function
+ * @name: the lkm module name, yes the name obtainable from THIS_MODULE!
+ *
+ * returns:
+ *	ENODEV if dev is a null pointer
+ * 	0 on success, or nothing to do
+ */
+int fifo_request_kill_write(struct fifo_dev* dev, const char* name)
+{
+	int act;
+
+	if (0 == dev)
+	{
+		printk(KERN_INFO "--- kill failed: null ptr device!\n");
+		return ENODEV;
+	}
+
+	// writers over the byte budget do not hold a count of full
+	act = fifo_bytes_kill(dev, name);
+	act += fifo_kill(dev, name, 1, !act);
+
+	trace_fifo_kill_request(name, 1, act);
+	return 0;
+}
+
+/*
+ * Kill a specific reader blocked in fifo_read_tag, like
+ * fifo_request_kill_read does for the plain readers.
+ *
+ * @dev: a device set up by fifo_init_tagged
+ * @tag: the channel the reader waits on
+ * @name: the lkm module name, yes the name obtainable from THIS_MODULE!
+ *
+ * returns:
+ *	see fifo_request_kill_read
+ * 	EINVAL if dev is not tagged or has no channel tag
+ */
+int fifo_request_kill_read_tag(struct fifo_dev* dev, unsigned int tag, const char* name)
+{
+	if (0 == dev)
+	{
+		printk(KERN_INFO "--- kill failed: null ptr device!\n");
+		return ENODEV;
+	}
+
+	if (!dev->tagged || tag >= dev->nr_shards)
+		return EINVAL;
+
+	return fifo_request_kill_read(dev->shards + tag, name);
+}
+
+// -------- unblock end --------------------------------------------------
+
+// -------- sharded mode -------------------------------------------------
+
+/*
+ * Take an item from the shard sh of dev, see fifo_shard_take. A shard
+ * another reader holds is passed over like an empty one, so the shards
+ * never put a reader to sleep.
+ * @drop: see fifo_remove
+ *
+ * returns:
+ *	ERR_PTR(-EAGAIN) if sh is empty or busy
+ *	see fifo_read otherwise
+ */
+static struct data_item* fifo_shard_try_take(struct fifo_dev* dev, struct fifo_dev* sh, const char* name, int drop)
+{
+	struct data_item* item;
+
+	if (down_trylock(&sh->empty))
+		return ERR_PTR(-EAGAIN);
+
+	if (!fifo_read_trylock(sh))
+	{
+		fifo_up(sh, &sh->empty);
+		return ERR_PTR(-EAGAIN);
+	}
+
+	item = fifo_remove(sh, name, drop);
+	fifo_read_unlock(sh);
+
+	fifo_up(dev, &dev->full);
+	fifo_bytes_put(dev, item);
+	if (!drop)
+		fifo_track_gap(ktime_get_ns(), &dev->last_remove, &dev->remove_gap);
+	wake_up_interruptible(&dev->poll_wait);
+
+	return item;
+}
+
+/*
+ * Put item into the shard sh of dev, see fifo_shard_put. Like a take,
+ * a shard another writer holds is passed over.
+ *
+ * returns:
+ *	EAGAIN if sh is full or busy
+ *	see fifo_write otherwise
+ */
+static int fifo_shard_try_put(struct fifo_dev* dev, struct fifo_dev* sh, struct data_item* item, const char* name)
+{
+	int err = fifo_write_nowait(sh, item, name);
+
+	// the count of empty of dev came with the insert
+	if (0 == err)
+	{
+		fifo_track_gap(ktime_get_ns(), &dev->last_insert, &dev->insert_gap);
+		wake_up_interruptible(&dev->poll_wait);
+		fifo_notify(dev);
+	}
+	else if (err != EAGAIN)
+		fifo_up(dev, &dev->full);
+
+	return err;
+}
+
+/*
+ * Level l of dev has just been served: the lower levels that still hold
+ * items have been passed over once more, see fifo_set_aging
+ */
+static void fifo_level_skip(struct fifo_dev* dev, unsigned int l)
+{
+	unsigned int i;
+
+	WRITE_ONCE(dev->shards[l].skipped, 0);
+
+	for (i = 0; i < l; ++i)
+		if (READ_ONCE(dev->shards[i].empty.count))
+			WRITE_ONCE(dev->shards[i].skipped, dev->shards[i].skipped + 1);
+}
+
+/*
+ * Take an item from the priority levels of dev, the caller already holds
+ * one count of dev->empty. Serves the highest level that holds an item,
+ * unless a lower one has been passed over dev->age times.
+ *
+ * @lowest: take from the lowest level instead and drop the item,
+ *	for FIFO_DROP_OLDEST
+ *
+ * returns:
+ *	see fifo_read
+ */
+static struct data_item* fifo_level_take(struct fifo_dev* dev, const char* name, int lowest)
+{
+	unsigned int i, l;
+	struct data_item* item;
+
+	while (1)
+	{
+		// aged levels first, the lowest of them before the others
+		for (i = 0; !lowest && dev->age && i < dev->nr_shards; ++i)
+		{
+			if (READ_ONCE(dev->shards[i].skipped) < dev->age)
+				continue;
+
+			item = fifo_shard_try_take(dev, dev->shards + i, name, lowest);
+			if (IS_ERR(item) && PTR_ERR(item) == -EAGAIN)
+				continue;
+
+			if (!IS_ERR(item))
+				fifo_level_skip(dev, i);
+			return item;
+		}
+
+		for (i = 0; i < dev->nr_shards; ++i)
+		{
+			l = lowest ? i : dev->nr_shards - 1 - i;
+
+			item = fifo_shard_try_take(dev, dev->shards + l, name, lowest);
+			if (IS_ERR(item) && PTR_ERR(item) == -EAGAIN)
+				continue;
+
+			if (!IS_ERR(item) && !lowest)
+				fifo_level_skip(dev, l);
+			return item;
+		}
+
+		// another taker raced us to our item, it is still in flight
+		cond_resched();
+	}
+}
+
+/*
+ * Take an item from the shards of dev, the caller already holds one count
+ * of dev->empty, so at least one shard has an item for it.
+ * Starts at the shard of the current CPU and steals from the others.
+ * @drop: see fifo_remove, with levels it takes from the lowest one
+ *
+ * returns:
+ *	see fifo_read
+ */
+static struct data_item* fifo_shard_take(struct fifo_dev* dev, const char* name, int drop)
+{
+	unsigned int i;
+	unsigned int cpu = raw_smp_processor_id();
+	struct data_item* item;
+
+	if (dev->prio)
+		return fifo_level_take(dev, name, drop);
+
+	while (1)
+	{
+		for (i = 0; i < dev->nr_shards; ++i)
+		{
+			item = fifo_shard_try_take(dev, dev->shards + (cpu + i) % dev->nr_shards, name, drop);
+			if (!IS_ERR(item) || PTR_ERR(item) != -EAGAIN)
+				return item;
+		}
+
+		// a filtered reader took our item, our count of empty is spent
+		if (atomic_add_unless(&dev->gate_debt, -1, 0))
+			return ERR_PTR(-EAGAIN);
+
+		// another taker raced us to our item, it is still in flight
+		cond_resched();
+	}
+}
+
+/*
+ * Put an item into the shards of dev, the caller already holds one count
+ * of dev->full, so at least one shard has space for it.
+ * Prefers the shard of the current CPU. Priority levels are as large as
+ * dev, so the level of the item always has space.
+ *
+ * returns:
+ *	see fifo_write
+ */
+static int fifo_shard_put(struct fifo_dev* dev, struct data_item* item, const char* name)
+{
+	int err;
+	unsigned int i;
+	unsigned int cpu = raw_smp_processor_id();
+	struct fifo_dev* level;
+
+	if (dev->prio || dev->tagged)
+	{
+		if (dev->prio)
+			level = dev->shards + min(item->prio, dev->nr_shards - 1);
+		else if (item->tag < dev->nr_shards)
+			level = dev->shards + item->tag;
+		else
+		{
+			fifo_up(dev, &dev->full);
+			return EINVAL;
+		}
+
+		// a reader may not have given back the slot it took yet
+		while (EAGAIN == (err = fifo_shard_try_put(dev, level, item, name)))
+			cond_resched();
+		return err;
+	}
+
+	while (1)
+	{
+		for (i = 0; i < dev->nr_shards; ++i)
+		{
+			err = fifo_shard_try_put(dev, dev->shards + (cpu + i) % dev->nr_shards, item, name);
+			if (err != EAGAIN)
+				return err;
+		}
+
+		cond_resched();
+	}
+}
+
+// -------- sharded mode end ---------------------------------------------
+
+// -------- expiry -------------------------------------------------------
+
+/*
+ * Discard item if it outlived its ttl, or the ttl of dev.
+ * Only called on the device readers use, never on a shard: the gate
+ * already handed out the count of the item.
+ *
+ * returns:
+ *	1 if item was freed, the caller has to read again
+ *	0 if item is valid, or an ERR_PTR
+ */
+static int fifo_expired(struct fifo_dev* dev, struct data_item* item)
+{
+	struct fifo_pcpu_stats* pc;
+	u64 ttl;
+
+	if (IS_ERR(item))
+		return 0;
+
+	ttl = item->ttl_ns ? item->ttl_ns : dev->ttl_ns;
+	if (0 == ttl || item->deq_ns - item->enq_ns <= ttl)
+		return 0;
+
+	pc = get_cpu_ptr(dev->pcpu);
+	++pc->expired;
+	put_cpu_ptr(dev->pcpu);
+
+	fifo_ack(item, ETIME);
+	free_di(item);
+	return 1;
+}
+
+// -------- expiry end ---------------------------------------------------
+
+/*
+ * Take the item at dev->front, the caller already holds one count of
+ * dev->empty.
+ *
+ * @dev: the fifo device
+ * @name: 	name of the calling lkm (obtained from THIS_MODULE),
+ * 			or 0 for user space.
+ * @drop: see fifo_shard_take
+ * @nowait: give up instead of waiting for another read
+ *
+ * returns:
+ *	see fifo_read
+ *	ERR_PTR(-EAGAIN) if nowait and another read is in progress
+ */
+static struct data_item* fifo_take(struct fifo_dev* dev, const char* name, int drop, int nowait)
+{
+	struct data_item* item;
+
+	if (dev->shards)
+		return fifo_shard_take(dev, name, drop);
+
+	if (nowait && !fifo_read_trylock(dev))
+	{
+		fifo_up(dev, &dev->empty);
+		return ERR_PTR(-EAGAIN);
+	}
+
+	// block if another read is in progress
+	if (!nowait && fifo_read_lock(dev))
+	{
+		fifo_up(dev, &dev->empty);
+		return ERR_PTR(-EINTR);
+	}
+
+	item = fifo_remove(dev, name, drop);
+
+	fifo_read_unlock(dev);
+
+	// wake pollers waiting for free space
+	wake_up_interruptible(&dev->poll_wait);
+	return item;
+}
+
+/** 
+ * Read the first entry from the buffer.
+ * Entries past their ttl are discarded on the way.
+ * This function may block!
+ *
+ * @dev: the fifo device
+ * @name: 	name of the calling lkm (obtained from THIS_MODULE),
+ * 			or 0 for user space.
+ *
+ * returns: 
+ *	ptr to the read struct
+ * 	ERR_PTR(ENODEV) if dev is a null pointer
+ * 	ERR_PTR(EWOULDBLOCK) if calling lkm wants to unload
+ *	ERR_PTR(EINTR) if mutex/semaphore locking was interrupted
+ */
+struct data_item* fifo_read(struct fifo_dev* dev, const char* name)
+{
+	int err;
+	struct data_item* item;
+
+	if (0 == dev)
 	{
-		printk(KERN_INFO "--- fifo reinitialization not permitted!\n");
-		return EPERM;
+		printk(KERN_INFO "--- fifo_read failed: null ptr device!\n");
+		return ERR_PTR(-ENODEV);
 	}
 
-	if (size < 1)
-		dev->size = BUF_STDSIZE;
+	do
+	{
+		if (dev->pubsub)
+			item = fifo_group_read(dev, name, 0);
+
+		// block if empty, maybe spin briefly before
+		else if ((err = fifo_wait(dev, &dev->empty, READ_ONCE(dev->insert_gap), name)))
+			return ERR_PTR(-EWOULDBLOCK == err ? err : -EINTR);
+		else
+			item = fifo_take(dev, name, 0, 0);
+
+	// a filtered reader may have taken the item of a tagged device
+	} while (!dev->parent && (fifo_expired(dev, item) || item == ERR_PTR(-EAGAIN)));
+
+	return fifo_consumed(dev, item);
+}
+
+/** 
+ * Read the first entry from the buffer without waiting for one.
+ *
+ * @dev: the fifo device
+ * @name: 	name of the calling lkm (obtained from THIS_MODULE),
+ * 			or 0 for user space.
+ *
+ * returns: 
+ *	see fifo_read
+ * 	ERR_PTR(EAGAIN) if the buffer is empty or another read is in progress
+ */
+struct data_item* fifo_read_nowait(struct fifo_dev* dev, const char* name)
+{
+	struct data_item* item;
+
+	if (0 == dev)
+	{
+		printk(KERN_INFO "--- fifo_read failed: null ptr device!\n");
+		return ERR_PTR(-ENODEV);
+	}
+
+	do
+	{
+		if (dev->pubsub)
+			item = fifo_group_read(dev, name, 1);
+		else if (down_trylock(&dev->empty))
+			return ERR_PTR(-EAGAIN);
+		else
+			item = fifo_take(dev, name, 0, 1);
+	} while (!dev->parent && fifo_expired(dev, item));
+
+	return fifo_consumed(dev, item);
+}
+
+/**
+ * Read the first entry of the channel tag of a tagged device, see
+ * fifo_init_tagged. Items of other channels are left alone.
+ * This function may block!
+ *
+ * @dev: the fifo device
+ * @tag: the channel
+ * @name: 	name of the calling lkm (obtained from THIS_MODULE),
+ * 			or 0 for user space.
+ *
+ * returns:
+ *	see fifo_read
+ * 	ERR_PTR(EINVAL) if dev is not tagged or has no channel tag
+ * 	ERR_PTR(EWOULDBLOCK) after fifo_request_kill_read_tag
+ */
+struct data_item* fifo_read_tag(struct fifo_dev* dev, unsigned int tag, const char* name)
+{
+	struct data_item* item;
+
+	if (0 == dev)
+	{
+		printk(KERN_INFO "--- fifo_read failed: null ptr device!\n");
+		return ERR_PTR(-ENODEV);
+	}
+
+	if (!dev->tagged || tag >= dev->nr_shards)
+		return ERR_PTR(-EINVAL);
+
+	do
+	{
+		item = fifo_read(dev->shards + tag, name);
+		if (IS_ERR(item))
+			return item;
+
+		// the count of empty for the item, if a plain reader got it
+		// first, it finds no item and settles the debt
+		if (down_trylock(&dev->empty))
+			atomic_inc(&dev->gate_debt);
+
+		fifo_up(dev, &dev->full);
+		fifo_bytes_put(dev, item);
+		fifo_track_gap(ktime_get_ns(), &dev->last_remove, &dev->remove_gap);
+		wake_up_interruptible(&dev->poll_wait);
+	} while (fifo_expired(dev, item));
+
+	return fifo_consumed(dev, item);
+}
+
+/*
+ * Get the item *pos places behind the front of dev without removing
+ * it, or subtract the number of items in dev from *pos.
+ *
+ * returns:
+ *	see fifo_peek
+ */
+static struct data_item* fifo_peek_at(struct fifo_dev* dev, size_t* pos)
+{
+	size_t used;
+	struct data_item* item = ERR_PTR(-ENOENT);
+
+	// removals stand still while we hold the read mutex
+	if (fifo_read_lock(dev))
+		return ERR_PTR(-EINTR);
+
+	// the slots before insertitions are written, see fifo_insert
+	used = smp_load_acquire(&dev->insertitions) - dev->removals;
+	if (*pos < used)
+	{
+		item = dev->buffer[(dev->front + *pos) % dev->slots];
+		kref_get(&item->ref);
+	}
+	else
+		*pos -= used;
+
+	fifo_read_unlock(dev);
+	return item;
+}
+
+/**
+ * Get the item pos places behind the front without removing it.
+ * The items of shards are counted one shard after the other, priority
+ * levels highest first. Holds the read mutex only briefly, so pos may
+ * refer to a different item by the next call.
+ *
+ * @dev: the fifo device
+ * @pos: 0 for the next item fifo_read would return
+ *
+ * returns:
+ *	ptr to the item, the caller holds a reference and drops it with free_di
+ * 	ERR_PTR(ENODEV) if dev is a null pointer
+ * 	ERR_PTR(ENOENT) if no more than pos items are queued
+ *	ERR_PTR(EINTR) if mutex locking was interrupted
+ */
+struct data_item* fifo_peek(struct fifo_dev* dev, size_t pos)
+{
+	unsigned int i;
+	struct data_item* item;
+
+	if (0 == dev)
+	{
+		printk(KERN_INFO "--- fifo_peek failed: null ptr device!\n");
+		return ERR_PTR(-ENODEV);
+	}
+
+	if (0 == dev->shards)
+		return fifo_peek_at(dev, &pos);
+
+	for (i = 0; i < dev->nr_shards; ++i)
+	{
+		item = fifo_peek_at(dev->shards + (dev->prio ? dev->nr_shards - 1 - i : i), &pos);
+		if (!IS_ERR(item) || PTR_ERR(item) != -ENOENT)
+			return item;
+	}
+
+	return ERR_PTR(-ENOENT);
+}
+
+/*
+ * Store item at dev->end, the caller already holds one count of
+ * dev->full and the bytes of item. Gives both back on failure.
+ *
+ * @dev: the fifo device
+ * @item: the data_item ptr which will be written
+ * @name: 	name of the calling lkm (obtained from THIS_MODULE),
+ * 			or 0 for user space.
+ * @nowait: give up instead of waiting for another write, never combines
+ *
+ * returns:
+ *	see fifo_write
+ *	EAGAIN if nowait and another write is in progress
+ */
+static int fifo_put(struct fifo_dev* dev, struct data_item* item, const char* name, int nowait)
+{
+	int err;
+
+	if (dev->shards)
+	{
+		err = fifo_shard_put(dev, item, name);
+		if (err)
+			fifo_bytes_put(dev, item);
+		return err;
+	}
+
+	// a published write waits for the holder of write, nowait does not
+	if (dev->combine && !nowait)
+		return fifo_combine_put(dev, item, name);
+
+	if (nowait && !fifo_write_trylock(dev))
+	{
+		fifo_up(dev, &dev->full);
+		fifo_bytes_put(dev, item);
+		return EAGAIN;
+	}
+
+	// block if another write is in progress
+	if (!nowait && fifo_write_lock(dev))
+	{
+		fifo_up(dev, &dev->full);
+		fifo_bytes_put(dev, item);
+		return EINTR;
+	}
+
+	fifo_insert(dev, item, name);
+
+	fifo_write_unlock(dev);
+
+	// wake pollers waiting for data
+	wake_up_interruptible(&dev->poll_wait);
+	return 0;
+}
+
+// -------- overflow policies --------------------------------------------
+
+/*
+ * Write item if there is space and budget for it, see fifo_write_nowait
+ *
+ * @nowait: give up instead of waiting for another write as well
+ *
+ * returns:
+ *	see fifo_write_nowait
+ */
+static int fifo_write_try(struct fifo_dev* dev, struct data_item* item, const char* name, int nowait)
+{
+	int err;
+
+	err = fifo_bytes_get(dev, item, name, 1);
+	if (err)
+		return err;
+
+	if (down_trylock(&dev->full))
+	{
+		fifo_bytes_put(dev, item);
+		return EAGAIN;
+	}
+
+	return fifo_put(dev, item, name, nowait);
+}
+
+/*
+ * Count a write refused (dropped == 0) or an item freed (dropped == 1)
+ * by the overflow policy of dev
+ */
+static void fifo_count_overflow(struct fifo_dev* dev, int dropped)
+{
+	struct fifo_pcpu_stats* pc = get_cpu_ptr(dev->pcpu);
+
+	if (dropped)
+		++pc->dropped;
 	else
-		dev->size = size;
+		++pc->rejected;
+
+	put_cpu_ptr(dev->pcpu);
+}
+
+/*
+ * Free the oldest item of dev to make room for a write, exactly one.
+ * With priority levels, the oldest item of the lowest level.
+ * An item past its ttl counts as expired instead of dropped.
+ *
+ * returns:
+ *	0 if an item was freed
+ *	EAGAIN if there was none; the free slots are all taken by writers
+ *		that have not inserted yet
+ *	see fifo_read otherwise
+ */
+static int fifo_drop_oldest(struct fifo_dev* dev, const char* name)
+{
+	struct data_item* old;
+	int err;
+
+	if (dev->pubsub)
+	{
+		err = fifo_group_drop_oldest(dev, name);
+		if (0 == err)
+			fifo_count_overflow(dev, 1);
+		return err;
+	}
+
+	if (down_trylock(&dev->empty))
+		return EAGAIN;
+
+	// with levels from the lowest one, not the next one to be read
+	old = fifo_take(dev, name, 1, 0);
+
+	// EAGAIN too if a filtered reader took the item of a tagged device
+	if (IS_ERR(old))
+		return -PTR_ERR(old);
+
+	if (fifo_expired(dev, old))
+		return 0;
+
+	fifo_count_overflow(dev, 1);
+	fifo_ack(old, ECANCELED);
+	free_di(old);
+	return 0;
+}
+
+/*
+ * fifo_write for the policies that never wait for a reader
+ *
+ * returns:
+ *	see fifo_write
+ */
+static int fifo_write_overflow(struct fifo_dev* dev, struct data_item* item, const char* name)
+{
+	int err;
+
+	// a busy mutex is no reason to refuse or drop, only waited for
+	if (FIFO_REJECT == dev->policy)
+	{
+		err = fifo_write_try(dev, item, name, 0);
+		if (EAGAIN == err)
+		{
+			fifo_count_overflow(dev, 0);
+			return ENOSPC;
+		}
+		return err;
+	}
+
+	// FIFO_DROP_OLDEST, over the byte budget this frees items as well
+	while (EAGAIN == (err = fifo_write_try(dev, item, name, 0)))
+	{
+		err = fifo_drop_oldest(dev, name);
+		if (EAGAIN == err)
+			cond_resched();
+		else if (err)
+			return err;
+	}
+	return err;
+}
+
+// -------- overflow policies end ----------------------------------------
+
+/**
+ * read the first entry from the buffer
+ *
+ * @dev: the fifo device
+ * @item: the data_item ptr which will be written
+ * @name: 	name of the calling lkm (obtained from THIS_MODULE),
+ * 			or 0 for user space.
+ *
+ * returns: 
+ *	0 on success
+ * 	EWOULDBLOCK if calling lkm wants to unload
+ *	ENODEV if dev is a null pointer
+ *	EINTR if mutex/semaphore locking was interrupted
+ *	EMSGSIZE if item alone exceeds the byte budget
+ *	ENOSPC if the buffer is full and the policy is FIFO_REJECT
+ */
+int fifo_write(struct fifo_dev* dev, struct data_item* item, const char* name)
+{
+	int err;
+
+	if (0 == dev)
+	{
+		printk(KERN_INFO "--- fifo_write failed: null ptr device!\n");
+		return ENODEV;
+	}
+
+	if (dev->policy != FIFO_BLOCK)
+		return fifo_write_overflow(dev, item, name);
+
+	// block if over the byte budget
+	err = fifo_bytes_get(dev, item, name, 0);
+	if (err)
+		return err;
+
+	// block if queue is full, maybe spin briefly before
+	err = fifo_wait(dev, &dev->full, READ_ONCE(dev->remove_gap), name);
+	if (err)
+	{
+		fifo_bytes_put(dev, item);
+		return -EWOULDBLOCK == err ? EWOULDBLOCK : EINTR;
+	}
+
+	return fifo_put(dev, item, name, 0);
+}
+
+/**
+ * Write an entry to the buffer without waiting for free space.
+ *
+ * @dev: the fifo device
+ * @item: the data_item ptr which will be written
+ * @name: 	name of the calling lkm (obtained from THIS_MODULE),
+ * 			or 0 for user space.
+ *
+ * returns: 
+ *	see fifo_write
+ *	EAGAIN if the buffer is full, over the byte budget or another write
+ *	is in progress
+ */
+int fifo_write_nowait(struct fifo_dev* dev, struct data_item* item, const char* name)
+{
+	if (0 == dev)
+	{
+		printk(KERN_INFO "--- fifo_write failed: null ptr device!\n");
+		return ENODEV;
+	}
+
+	return fifo_write_try(dev, item, name, 1);
+}
+
+/*
+ * Free what fifo_init_dev allocated
+ */
+static void fifo_free_dev(struct fifo_dev* dev)
+{
+	free_percpu(dev->pcpu);
+	dev->pcpu = 0;
+
+	kfree(dev->producer_names);
+	dev->producer_names = 0;
+	kfree(dev->producer_lat);
+	dev->producer_lat = 0;
+	kfree(dev->groups);
+	dev->groups = 0;
+}
+
+/*
+ * Set up the semaphores, locks and counters of dev for size items.
+ * The producer tables and consumer groups are left to a device without
+ * parent, a shard uses those of its sharded device.
+ *
+ * @parent: the sharded device of a shard, else 0
+ *
+ * returns:
+ *	ENOMEM if the per-CPU stats or the tables could not be allocated
+ *	0 on success
+ */
+static int fifo_init_dev(struct fifo_dev* dev, size_t size, struct fifo_dev* parent)
+{
+	dev->size = size;
+	dev->slots = size;
+	dev->shrink_pending = 0;
 
 	sema_init(&dev->full, dev->size);
 	sema_init(&dev->empty, 0);
-	sema_init(&dev->wait_on_kill, 0);
+	init_waitqueue_head(&dev->full_wait);
+	init_waitqueue_head(&dev->empty_wait);
 
 	mutex_init(&dev->read);
 	mutex_init(&dev->write);
 
+	init_waitqueue_head(&dev->poll_wait);
+
 	dev->insertitions = 0;
 	dev->removals = 0;
 	dev->seq_no = 0;
@@ -456,14 +2651,492 @@ int fifo_init(struct fifo_dev* dev, size_t size)
 	dev->front = 0;
 	dev->end = 0;
 
-	dev->kill = 0;
-	dev->mod_to_kill = 0; 
+	spin_lock_init(&dev->wait_lock);
+	INIT_LIST_HEAD(&dev->read_waiters);
+	INIT_LIST_HEAD(&dev->write_waiters);
+	INIT_LIST_HEAD(&dev->kills);
+
+	dev->shards = 0;
+	dev->nr_shards = 0;
+	dev->prio = 0;
+	dev->tagged = 0;
+	dev->age = 0;
+	dev->skipped = 0;
+	dev->parent = parent;
+	atomic64_set(&dev->shard_seq, 0);
+	atomic_set(&dev->gate_debt, 0);
+
+	dev->combine = 0;
+	init_llist_head(&dev->write_reqs);
+
+	dev->spin_ns = 0;
+
+	dev->max_bytes = 0;
+	dev->policy = FIFO_BLOCK;
+	dev->ttl_ns = 0;
+	dev->pubsub = 0;
+	atomic_long_set(&dev->bytes, 0);
+	init_waitqueue_head(&dev->bytes_wait);
+	spin_lock_init(&dev->bytes_lock);
+	INIT_LIST_HEAD(&dev->bytes_waiters);
+	spin_lock_init(&dev->notify_lock);
+	INIT_LIST_HEAD(&dev->notifiers);
+
+	dev->last_insert = 0;
+	dev->insert_gap = 0;
+	dev->last_remove = 0;
+	dev->remove_gap = 0;
+
+	memset(&dev->write_hold, 0, sizeof(dev->write_hold));
+	memset(&dev->read_hold, 0, sizeof(dev->read_hold));
+
+	dev->created = ktime_get_ns();
+	dev->peak = 0;
+	dev->enq_in = 0;
+	dev->enq_out = 0;
+	dev->drops = 0;
+	dev->drop_delay = 0;
+
+	spin_lock_init(&dev->producer_lock);
+	spin_lock_init(&dev->lat_lock);
+	dev->nr_producers = 0;
+	memset(&dev->queue_delay, 0, sizeof(dev->queue_delay));
+
+	if (0 == parent)
+	{
+		dev->producer_names = kcalloc(FIFO_MAX_PRODUCERS, MODULE_NAME_LEN, GFP_KERNEL);
+		dev->producer_lat = kcalloc(FIFO_MAX_PRODUCERS, sizeof(struct fifo_hist), GFP_KERNEL);
+		dev->groups = kcalloc(FIFO_MAX_GROUPS, sizeof(struct fifo_group), GFP_KERNEL);
+	}
+
+	// zeroed by alloc_percpu
+	dev->pcpu = alloc_percpu(struct fifo_pcpu_stats);
+
+	if (0 == dev->pcpu || (0 == parent && (0 == dev->producer_names || 0 == dev->producer_lat || 0 == dev->groups)))
+	{
+		fifo_free_dev(dev);
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Set up dev with a buffer of size items, see fifo_init
+ *
+ * @parent: see fifo_init_dev
+ */
+static int fifo_init_buffer(struct fifo_dev* dev, size_t size, struct fifo_dev* parent)
+{
+	int err;
+
+	err = fifo_init_dev(dev, size, parent);
+	if (err)
+		return err;
 
 	dev->buffer = kmalloc(dev->size * sizeof(struct data_item*), GFP_KERNEL);
+	if (0 == dev->buffer)
+	{
+		fifo_free_dev(dev);
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * initializes the device, creates the buffer 
+ *
+ * @dev: the fifo device
+ * @size: buffer size or 0 for default size (BUF_STDSIZE)
+ *
+ * returns: 
+ *	EPERM if device has allready been used 
+ * 	ENODEV if dev is a null pointer
+ *	ENOMEM if the buffer could not be allocated
+ * 	0 on success
+ */
+int fifo_init(struct fifo_dev* dev, size_t size)
+{
+	if (0 == dev)
+	{
+		printk(KERN_INFO "--- fifo initialization failed: no device!\n");
+		return ENODEV;
+	}
+
+	if (dev->buffer != 0 || dev->shards != 0)
+	{
+		printk(KERN_INFO "--- fifo reinitialization not permitted!\n");
+		return EPERM;
+	}
+
+	return fifo_init_buffer(dev, size < 1 ? BUF_STDSIZE : size, 0);
+}
+
+/*
+ * Set up dev as the gate of nr shards of shard_size items each,
+ * see fifo_init_sharded and fifo_init_prio
+ *
+ * @size: the capacity of dev itself
+ *
+ * returns:
+ *	see fifo_init
+ */
+static int fifo_init_shards(struct fifo_dev* dev, size_t size, size_t shard_size, unsigned int nr)
+{
+	int err;
+	unsigned int i;
+
+	if (0 == dev)
+	{
+		printk(KERN_INFO "--- fifo initialization failed: no device!\n");
+		return ENODEV;
+	}
+
+	if (dev->buffer != 0 || dev->shards != 0)
+	{
+		printk(KERN_INFO "--- fifo reinitialization not permitted!\n");
+		return EPERM;
+	}
+
+	err = fifo_init_dev(dev, size, 0);
+	if (err)
+		return err;
+
+	dev->shards = kcalloc(nr, sizeof(struct fifo_dev), GFP_KERNEL);
+	if (0 == dev->shards)
+	{
+		fifo_free_dev(dev);
+		return ENOMEM;
+	}
+
+	for (i = 0; i < nr; ++i)
+	{
+		err = fifo_init_buffer(dev->shards + i, shard_size, dev);
+		if (err)
+		{
+			dev->nr_shards = i;
+			fifo_destroy(dev);
+			return err;
+		}
+	}
+	dev->nr_shards = nr;
+
+	return 0;
+}
+
+/**
+ * initializes a sharded device with nr sub-queues of size items each.
+ * dev itself holds no buffer, its semaphores count the items and free
+ * slots of all shards and its kill requests apply to all of them.
+ * Ordering is only kept per shard, qids stay unique.
+ *
+ * @dev: the fifo device
+ * @size: size of one shard or 0 for default size (BUF_STDSIZE)
+ * @nr: number of shards, usually one per possible CPU
+ *
+ * returns: 
+ *	see fifo_init
+ */
+int fifo_init_sharded(struct fifo_dev* dev, size_t size, unsigned int nr)
+{
+	if (size < 1)
+		size = BUF_STDSIZE;
+
+	return fifo_init_shards(dev, size * nr, size, nr);
+}
+
+/**
+ * initializes a device with nr priority levels sharing size items.
+ * Built like a sharded device, but an item goes to the level of its
+ * prio (the highest one if prio is larger) and readers get the item of
+ * the highest non-empty level. Every level can hold all size items, so
+ * only dev->full limits writers. Ordering is kept per level.
+ *
+ * @dev: the fifo device
+ * @size: buffer size or 0 for default size (BUF_STDSIZE)
+ * @nr: number of levels
+ *
+ * returns: 
+ *	see fifo_init
+ */
+int fifo_init_prio(struct fifo_dev* dev, size_t size, unsigned int nr)
+{
+	int err;
+
+	if (size < 1)
+		size = BUF_STDSIZE;
+
+	err = fifo_init_shards(dev, size, size, nr);
+	if (0 == err)
+		dev->prio = 1;
+	return err;
+}
+
+/**
+ * initializes a device with nr channels sharing size items.
+ * Built like the priority levels, but an item goes to the channel of
+ * its tag and is refused if there is none. fifo_read serves all
+ * channels, fifo_read_tag only one of them without looking at the
+ * items of the others. Ordering is kept per channel.
+ *
+ * @dev: the fifo device
+ * @size: buffer size or 0 for default size (BUF_STDSIZE)
+ * @nr: number of channels
+ *
+ * returns: 
+ *	see fifo_init
+ */
+int fifo_init_tagged(struct fifo_dev* dev, size_t size, unsigned int nr)
+{
+	int err;
+
+	if (size < 1)
+		size = BUF_STDSIZE;
+
+	err = fifo_init_shards(dev, size, size, nr);
+	if (0 == err)
+		dev->tagged = 1;
+	return err;
+}
 
+/**
+ * Let a priority level that holds items go first after it has been
+ * passed over age times, so bulk traffic still moves while the higher
+ * levels are busy.
+ *
+ * @dev: a device set up by fifo_init_prio
+ * @age: 0 for strict priorities
+ */
+void fifo_set_aging(struct fifo_dev* dev, unsigned int age)
+{
+	dev->age = age;
+}
+
+/**
+ * Switch the combining write path on or off, for dev and all its shards.
+ * Must be called before the device is used.
+ *
+ * @dev: the fifo device
+ * @on: 1 to let the holder of the write mutex apply all pending writes
+ */
+void fifo_set_combining(struct fifo_dev* dev, int on)
+{
+	unsigned int i;
+
+	dev->combine = on;
+	for (i = 0; i < dev->nr_shards; ++i)
+		dev->shards[i].combine = on;
+}
+
+/**
+ * Set the spin budget of dev, see fifo_wait.
+ *
+ * @dev: the fifo device
+ * @ns: longest time a waiter polls before it sleeps, 0 to never spin
+ */
+void fifo_set_spin(struct fifo_dev* dev, u64 ns)
+{
+	dev->spin_ns = ns;
+}
+
+/**
+ * Limit the memory of the queued items of dev, see fifo_item_bytes.
+ * Applies to the device as a whole, shards do not count on their own.
+ * Must be called before the device is used.
+ *
+ * @dev: the fifo device
+ * @bytes: the byte budget, 0 for none
+ */
+void fifo_set_max_bytes(struct fifo_dev* dev, size_t bytes)
+{
+	dev->max_bytes = bytes;
+}
+
+/**
+ * Choose what fifo_write does when dev is full (or over its byte budget).
+ * fifo_write_nowait is not affected. Refused writes and freed items are
+ * counted in the snapshot.
+ *
+ * @dev: the fifo device
+ * @policy: FIFO_BLOCK, FIFO_REJECT or FIFO_DROP_OLDEST
+ */
+void fifo_set_policy(struct fifo_dev* dev, enum fifo_policy policy)
+{
+	dev->policy = policy;
+}
+
+/**
+ * Let fifo_read discard items that were queued longer than ns,
+ * unless they carry their own ttl_ns.
+ *
+ * @dev: the fifo device
+ * @ns: the ttl, 0 to keep items forever
+ */
+void fifo_set_ttl(struct fifo_dev* dev, u64 ns)
+{
+	dev->ttl_ns = ns;
+}
+
+/**
+ * Continue the qids at seq, for a fifo refilled from a checkpoint.
+ * Must be called before the device is used.
+ *
+ * @dev: the fifo device
+ * @seq: the qid of the next item written
+ */
+void fifo_set_seq_no(struct fifo_dev* dev, u64 seq)
+{
+	if (dev->shards)
+		atomic64_set(&dev->shard_seq, seq);
+	else
+		dev->seq_no = seq;
+}
+
+/**
+ * Switch dev to publish/subscribe: every consumer group gets every item.
+ * The name passed to fifo_read selects the group, user space readers
+ * share one. A group is added by its first read, starting at the oldest
+ * item still held, and left by fifo_request_kill_read. An item stays
+ * until every group has read it, so the slowest group holds back the
+ * writers; readers get their own reference and free it with free_di.
+ * Must be called before the device is used.
+ *
+ * @dev: the fifo device, neither sharded nor with priority levels
+ * @on: 1 for publish/subscribe
+ *
+ * returns:
+ *	EINVAL if dev is sharded
+ *	0 on success
+ */
+int fifo_set_pubsub(struct fifo_dev* dev, int on)
+{
+	if (dev->shards)
+		return EINVAL;
+
+	dev->pubsub = on;
+	return 0;
+}
+
+/*
+ * Move the queued items of dev into a new buffer of slots entries,
+ * starting at 0. Needs dev->write and dev->read.
+ *
+ * returns:
+ *	ENOMEM if the buffer could not be allocated
+ *	0 on success
+ */
+static int fifo_realloc(struct fifo_dev* dev, size_t slots)
+{
+	size_t i;
+	size_t used = dev->insertitions - dev->removals;
+	struct data_item** buffer;
+
+	buffer = kmalloc(slots * sizeof(struct data_item*), GFP_KERNEL);
+	if (0 == buffer)
+		return ENOMEM;
+
+	for (i = 0; i < used; ++i)
+		buffer[i] = dev->buffer[(dev->front + i) % dev->slots];
+
+	kfree(dev->buffer);
+	dev->buffer = buffer;
+	dev->slots = slots;
+	dev->front = 0;
+	dev->end = used % slots;
 	return 0;
 }
 
+/**
+ * Change the capacity of dev while it is in use.
+ * A grow applies at once and wakes blocked writers. A shrink takes back
+ * the free slots it can get right away and the rest as readers free them,
+ * nothing is dropped. The buffer is only reallocated to grow; after a
+ * shrink it keeps its entries until the next grow.
+ *
+ * @dev: the fifo device, not sharded
+ * @size: the new capacity
+ *
+ * returns:
+ *	ENODEV if dev is a null pointer
+ *	EINVAL if size is 0 or dev is sharded
+ *	ENOMEM if the larger buffer could not be allocated
+ *	ERESTARTSYS if waiting for a lock was interrupted
+ *	0 on success
+ */
+int fifo_resize(struct fifo_dev* dev, size_t size)
+{
+	int ret = 0;
+	size_t diff;
+
+	if (0 == dev)
+	{
+		printk(KERN_INFO "--- fifo resize failed: no device!\n");
+		return ENODEV;
+	}
+
+	// the shards would have to be resized together with the gate
+	if (0 == size || dev->shards)
+		return EINVAL;
+
+	// same order as the kill requests
+	if (fifo_write_lock(dev))
+		return ERESTARTSYS;
+
+	if (fifo_read_lock(dev))
+	{
+		fifo_write_unlock(dev);
+		return ERESTARTSYS;
+	}
+
+	// writers holding a count of full may still insert up to the
+	// old size, so the buffer never gets smaller than that
+	if (size > dev->slots)
+	{
+		ret = fifo_realloc(dev, size);
+		if (ret)
+			goto out;
+	}
+
+	if (size >= dev->size)
+	{
+		diff = size - dev->size;
+		WRITE_ONCE(dev->size, size);
+
+		// cancel a pending shrink first
+		if (dev->shrink_pending >= diff)
+		{
+			dev->shrink_pending -= diff;
+			diff = 0;
+		}
+		else
+		{
+			diff -= dev->shrink_pending;
+			dev->shrink_pending = 0;
+		}
+
+		while (diff--)
+			fifo_up(dev, &dev->full);
+	}
+	else
+	{
+		diff = dev->size - size;
+		WRITE_ONCE(dev->size, size);
+
+		while (diff && 0 == down_trylock(&dev->full))
+			--diff;
+		dev->shrink_pending += diff;
+	}
+
+out:
+	fifo_read_unlock(dev);
+	fifo_write_unlock(dev);
+
+	if (0 == ret)
+		wake_up_interruptible(&dev->poll_wait);
+	return ret;
+}
+
 /**
  * destroys the device, frees the buffer
  *
@@ -485,11 +3158,24 @@ int fifo_destroy(struct fifo_dev* dev)
 	mutex_lock(&dev->write);
 	mutex_lock(&dev->read);
 
-	// free the remaining data_item structs
-	while (dev->front != dev->end)
+	// free the remaining data_item structs, front == end if full
+	while (dev->buffer && dev->removals != dev->insertitions)
+	{
+		free_di(dev->buffer[dev->front]);
+		dev->front = (dev->front +1) % dev->slots;
+		++dev->removals;
+	}
+
+	// requests nobody took
+	fifo_kill_forget(dev, 0);
+
+	// consumers that did not unregister
+	while (!list_empty(&dev->notifiers))
 	{
-		kfree(*(dev->buffer + dev->front));
-		++dev->front;
+		struct fifo_notifier* n = list_first_entry(&dev->notifiers, struct fifo_notifier, node);
+
+		list_del(&n->node);
+		kfree(n);
 	}
 
 	// kill all mutexes
@@ -501,6 +3187,20 @@ int fifo_destroy(struct fifo_dev* dev)
 	// do the same for all semas?
 
 	kfree(dev->buffer);
+	dev->buffer = 0;
+
+	fifo_free_dev(dev);
+
+	if (dev->shards)
+	{
+		unsigned int i;
+
+		for (i = 0; i < dev->nr_shards; ++i)
+			fifo_destroy(dev->shards + i);
+
+		kfree(dev->shards);
+		dev->shards = 0;
+	}
 
 	return 0;
 }
\ No newline at end of file
@@ -6,8 +6,17 @@
 #include <linux/slab.h>
 #include <linux/semaphore.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/cache.h>
+#include <linux/atomic.h>
+#include <linux/llist.h>
+#include <linux/list.h>
+#include <linux/completion.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
 #include <linux/string.h>
 #include <linux/module.h>
+#include <linux/workqueue.h>
 
 #include <asm/uaccess.h>
 
@@ -15,55 +24,339 @@
 
 #define BUF_STDSIZE 32
 
-struct fifo_dev {
+// log2 buckets of the latency histograms, the last one collects the rest
+#define FIFO_HIST_BUCKETS 32
+
+// producers with their own latency histogram, user space counts as one
+#define FIFO_MAX_PRODUCERS 16
+#define FIFO_USER_NAME "user"
+
+// consumer groups in publish/subscribe mode
+#define FIFO_MAX_GROUPS 8
+
+/*
+ * callback of an item, see fifo_set_ack
+ * @status: 0 once a reader took the item, ECANCELED if it was dropped
+ *	to make room, ETIME if it expired
+ */
+typedef void (*fifo_ack_fn)(void* ctx, size_t qid, int status);
+
+struct fifo_ack {
+	struct work_struct work;
+	fifo_ack_fn fn;
+	struct module* owner;		// pinned while the callback is due
+	void* ctx;
+	size_t qid;
+	int status;
+};
+
+/*
+ * a consumer told when the fifo becomes non-empty, see fifo_notify_add
+ */
+typedef void (*fifo_notify_fn)(void* ctx);
+
+struct fifo_notifier {
+	struct list_head node;
+	char name[MODULE_NAME_LEN];
+	fifo_notify_fn fn;
+	void* ctx;
+	int armed;
+};
+
+// what fifo_write does when the fifo is full, see fifo_set_policy
+enum fifo_policy {
+	FIFO_BLOCK,			// wait for a free slot
+	FIFO_REJECT,		// fail with ENOSPC
+	FIFO_DROP_OLDEST,	// free the oldest item to make room
+};
+
+// waits on a semaphore that could not be taken right away
+struct fifo_wait_stats {
+	unsigned long waits;
+	unsigned long spun;		// of waits, ended while polling
+	u64 total_ns;
+	u64 max_ns;
+};
+
+// how long a mutex was held, written by its holder only
+struct fifo_hold_stats {
+	u64 since;
+	unsigned long count;
+	u64 total_ns;
+	u64 max_ns;
+};
 
-	// --- device info ---
+// kept per CPU, so waiters never share a cacheline for them
+struct fifo_pcpu_stats {
+	struct fifo_wait_stats full;
+	struct fifo_wait_stats empty;
 
+	// writes failed and items freed by the overflow policy
+	unsigned long rejected;
+	unsigned long dropped;
+
+	// items discarded by fifo_read after their ttl
+	unsigned long expired;
+};
+
+// filled in by fifo_snapshot; the fields are sampled one by one, only
+// used, insertitions and removals are consistent with each other
+struct fifo_snapshot {
 	size_t size;
+	size_t used;
 	size_t insertitions;
 	size_t removals;
 	unsigned long long seq_no;
 
-	// --- internals ---
+	// queued payload and metadata, only counted with a byte budget
+	size_t bytes;
+	size_t max_bytes;
+
+	struct fifo_wait_stats full;
+	struct fifo_wait_stats empty;
+	unsigned long rejected;
+	unsigned long dropped;
+	unsigned long expired;
+	struct fifo_hold_stats write;
+	struct fifo_hold_stats read;
+	size_t peak;
+	size_t max_lag;			// items the slowest consumer group is behind
+	u64 area;				// occupancy integral, item * ns
+	u64 elapsed_ns;			// since fifo_init
+};
+
+/*
+ * A consumer group in publish/subscribe mode, see fifo_set_pubsub.
+ * Every group reads every item; the readers of one group share it.
+ * Protected by the read mutex of the device.
+ */
+struct fifo_group {
+	char name[MODULE_NAME_LEN];		// empty if the slot is unused
+	size_t next;					// insertion number of the next item to read
+	size_t consumed;
+	int waiters;					// readers sleeping for an item
+	int kill;						// the waiters leave the group
+};
+
+struct fifo_hist {
+	unsigned long bucket[FIFO_HIST_BUCKETS];
+	unsigned long count;
+	u64 sum;
+	u64 max;
+};
+
+/*
+ * The fields are grouped by who writes them: producers (under write),
+ * consumers (under read) and the read-mostly part set up by fifo_init.
+ * Each group starts on its own cacheline so that producers and consumers
+ * running on different CPUs do not invalidate each others lines. The
+ * semaphores are written by both, each has a line of its own.
+ */
+struct fifo_dev {
+
+	// --- device info, read-mostly ---
+
+	// capacity, see fifo_resize
+	size_t size;
+
+	// the device buffer of slots entries, more than size while a
+	// shrink is pending
+	struct data_item** buffer;
+	size_t slots;
+
+	// sub-queues in sharded mode (see fifo_init_sharded), else 0
+	struct fifo_dev* shards;
+	unsigned int nr_shards;
+
+	// 1 if the shards are priority levels, see fifo_init_prio
+	int prio;
+
+	// 1 if the shards are channels of tagged items, see fifo_init_tagged
+	int tagged;
+
+	// items served from higher levels before a waiting lower one goes
+	// first, 0 for strict priorities, see fifo_set_aging
+	unsigned int age;
+
+	// sharded device of a shard, hands out its qids, else 0
+	struct fifo_dev* parent;
+
+	// names of the producers, indexed like producer_lat; FIFO_MAX_PRODUCERS
+	// entries, only allocated for a device without parent
+	char (*producer_names)[MODULE_NAME_LEN];
+	int nr_producers;
+	spinlock_t producer_lock;
+
+	// combining write path, see fifo_set_combining
+	int combine;
+
+	// how long waiters may poll before sleeping, see fifo_set_spin
+	u64 spin_ns;
+
+	// byte budget, 0 for none, see fifo_set_max_bytes
+	size_t max_bytes;
+
+	// overflow policy of fifo_write
+	enum fifo_policy policy;
+
+	// ttl of items without their own, 0 for none, see fifo_set_ttl
+	u64 ttl_ns;
+
+	// 1 if every consumer group gets every item, see fifo_set_pubsub
+	int pubsub;
+
+	// time of fifo_init
+	u64 created;
+
+	// waits on full and empty
+	struct fifo_pcpu_stats __percpu* pcpu;
+
+	// --- producer side, protected by write ---
+
+	struct mutex write ____cacheline_aligned_in_smp;
 
-	// position of the first entry to read
-	size_t front;
 	// position of the first empty spot after the last element
 	size_t end;
+	size_t insertitions;
+	unsigned long long seq_no;
 
-	// unblock parameters
-	int kill;
-	const char* mod_to_kill;
+	// writes published for the holder of write in combining mode
+	struct llist_head write_reqs;
 
-	// the device buffer
-	struct data_item** buffer;
+	// time of the last insertion and average ns between insertions
+	u64 last_insert;
+	u64 insert_gap;
+
+	struct fifo_hold_stats write_hold;
+
+	// highest occupancy and sum of all enqueue times
+	size_t peak;
+	u64 enq_in;
 
-	// counting semaphores
-	struct semaphore full;
-	struct semaphore empty;
+	// --- consumer side, protected by read ---
+
+	struct mutex read ____cacheline_aligned_in_smp;
+
+	// position of the first entry to read
+	size_t front;
+	size_t removals;
 
-	// semaphore used during kill requests
-	struct semaphore wait_on_kill;
+	// counts of full a shrink still has to take back, see fifo_resize
+	size_t shrink_pending;
 
-	/* 
-	 * mutex protection for front (removals, kill_read) 
-	 * and end (insertitions, seq_no, kill_write)
-	 */
-	struct mutex read;
-	struct mutex write;
+	// as a priority level: times passed over while holding items
+	unsigned int skipped;
+
+	// cursors of the FIFO_MAX_GROUPS consumer groups in publish/subscribe
+	// mode, 0 in a shard, which never is in that mode
+	struct fifo_group* groups;
+
+	// time of the last removal and average ns between removals
+	u64 last_remove;
+	u64 remove_gap;
+
+	struct fifo_hold_stats read_hold;
+
+	// enqueue to dequeue delay of all items
+	struct fifo_hist queue_delay;
+
+	// sum of the enqueue times of all dequeued items
+	u64 enq_out;
+
+	// removals that were dropped, not read, and their summed queueing delay
+	size_t drops;
+	u64 drop_delay;
+
+	// creation to dequeue latency per producer slot, allocated like
+	// producer_names; the shards add to those of their parent under its
+	// lat_lock
+	struct fifo_hist* producer_lat;
+	spinlock_t lat_lock;
+
+	// --- semaphores, taken by one side and upped by the other ---
+
+	// free slots, producers sleep here
+	struct semaphore full ____cacheline_aligned_in_smp;
+
+	// used slots, consumers sleep here
+	struct semaphore empty ____cacheline_aligned_in_smp;
+
+	// --- shared ---
+
+	// woken on every insertion and removal, used by poll
+	wait_queue_head_t poll_wait ____cacheline_aligned_in_smp;
+
+	// sleepers on empty and full, the semaphores only count, see fifo_wait
+	wait_queue_head_t empty_wait;
+	wait_queue_head_t full_wait;
+
+	// sleepers by name and kill requests waiting for one, see
+	// fifo_request_kill_read
+	spinlock_t wait_lock;
+	struct list_head read_waiters;
+	struct list_head write_waiters;
+	struct list_head kills;
+
+	// next qid handed out by the shards of a sharded device
+	atomic64_t shard_seq;
+
+	// counts of empty taken by nobody, the items behind them went to
+	// filtered readers, see fifo_read_tag
+	atomic_t gate_debt;
+
+	// bytes reserved by queued and in-flight items, writers over
+	// budget sleep on bytes_wait and are listed in bytes_waiters
+	atomic_long_t bytes;
+	wait_queue_head_t bytes_wait;
+	spinlock_t bytes_lock;
+	struct list_head bytes_waiters;
+
+	// consumers to tell about new items, see fifo_notify_add
+	spinlock_t notify_lock;
+	struct list_head notifiers;
 };
 
 struct data_item* alloc_di(const char*, unsigned long long);
 struct data_item* alloc_di_str(char* str);
 void free_di(struct data_item*);
+int fifo_set_ack(struct data_item*, fifo_ack_fn, void*);
+
+int fifo_notify_add(struct fifo_dev*, const char*, fifo_notify_fn, void*);
+void fifo_notify_del(struct fifo_dev*, const char*);
+void fifo_notify_arm(struct fifo_dev*, const char*);
 
 struct data_item* fifo_read(struct fifo_dev*, const char*);
 int fifo_write(struct fifo_dev*, struct data_item*, const char*);
+struct data_item* fifo_read_nowait(struct fifo_dev*, const char*);
+struct data_item* fifo_read_tag(struct fifo_dev*, unsigned int, const char*);
+struct data_item* fifo_peek(struct fifo_dev*, size_t);
+int fifo_write_nowait(struct fifo_dev*, struct data_item*, const char*);
+int fifo_write_check(struct fifo_dev*, const struct data_item*);
 
 int fifo_request_kill_read(struct fifo_dev*, const char*);
 int fifo_request_kill_write(struct fifo_dev*, const char*);
+int fifo_request_kill_read_tag(struct fifo_dev*, unsigned int, const char*);
+void fifo_kill_forget(struct fifo_dev*, const char*);
 
 int fifo_init(struct fifo_dev*, size_t);
+int fifo_init_sharded(struct fifo_dev*, size_t, unsigned int);
+int fifo_init_prio(struct fifo_dev*, size_t, unsigned int);
+int fifo_init_tagged(struct fifo_dev*, size_t, unsigned int);
+void fifo_set_aging(struct fifo_dev*, unsigned int);
+void fifo_set_combining(struct fifo_dev*, int);
+void fifo_set_spin(struct fifo_dev*, u64);
+void fifo_set_max_bytes(struct fifo_dev*, size_t);
+void fifo_set_policy(struct fifo_dev*, enum fifo_policy);
+void fifo_set_ttl(struct fifo_dev*, u64);
+void fifo_set_seq_no(struct fifo_dev*, u64);
+int fifo_set_pubsub(struct fifo_dev*, int);
+int fifo_resize(struct fifo_dev*, size_t);
+size_t fifo_used(struct fifo_dev*);
+int fifo_readable(struct fifo_dev*, const char*);
+int fifo_writable(struct fifo_dev*);
+void fifo_counters(struct fifo_dev*, struct fifo_snapshot*);
+void fifo_snapshot(struct fifo_dev*, struct fifo_snapshot*);
+void fifo_latency(struct fifo_dev*, struct fifo_hist*, struct fifo_hist*);
 int fifo_destroy(struct fifo_dev*);
 
 #endif
\ No newline at end of file
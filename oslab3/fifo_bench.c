@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * Throughput benchmark for /dev/deeds_fifo.
+ * Starts a number of producer and consumer threads, each with its own file
+ * descriptor, and moves a fixed number of items through the queue.
+ * pread/pwrite with offset 0 are used, so one open() serves many items.
+ * Consumers read without blocking and stop once the producers are done
+ * and the queue is empty.
+ */
+
+int producers = 2;
+int consumers = 2;
+long items = 100000;		// per producer
+char* msg = "bench";
+char* dev = "/dev/deeds_fifo";
+
+// set once all producers returned
+int done;
+
+// items read by all consumers
+long consumed;
+
+void* produce(void* arg)
+{
+	long i;
+	char csv[64];
+	int len;
+	int file = open(dev, O_WRONLY);
+
+	if (-1 == file)
+	{
+		fprintf(stderr, "producer: open failed. error: %s\n", strerror(errno));
+		return 0;
+	}
+
+	len = snprintf(csv, sizeof(csv), "0,1,%s", msg);
+
+	for (i = 0; i < items; ++i)
+	{
+		if (pwrite(file, csv, len, 0) < 0)
+		{
+			fprintf(stderr, "producer: write failed. error: %s\n", strerror(errno));
+			break;
+		}
+	}
+
+	close(file);
+	return 0;
+}
+
+void* consume(void* arg)
+{
+	char csv[256];
+	int last;
+	struct pollfd pfd;
+	int file = open(dev, O_RDONLY | O_NONBLOCK);
+
+	if (-1 == file)
+	{
+		fprintf(stderr, "consumer: open failed. error: %s\n", strerror(errno));
+		return 0;
+	}
+
+	pfd.fd = file;
+	pfd.events = POLLIN;
+
+	while (1)
+	{
+		// empty after the producers were done, nothing more will come
+		last = __atomic_load_n(&done, __ATOMIC_ACQUIRE);
+
+		if (pread(file, csv, sizeof(csv), 0) >= 0)
+		{
+			__sync_fetch_and_add(&consumed, 1);
+			continue;
+		}
+
+		if (errno != EAGAIN)
+		{
+			fprintf(stderr, "consumer: read failed. error: %s\n", strerror(errno));
+			break;
+		}
+
+		if (last)
+			break;
+
+		// the timeout notices done
+		poll(&pfd, 1, 10);
+	}
+
+	close(file);
+	return 0;
+}
+
+int main(int argc, char* const* argv)
+{
+	int c, i;
+	double sec;
+	pthread_t* threads;
+	struct timespec start, stop;
+
+	while ((c = getopt(argc, argv, "p:c:n:d:")) != -1)
+	{
+		switch (c)
+		{
+		case 'p':
+			producers = atoi(optarg);
+			break;
+		case 'c':
+			consumers = atoi(optarg);
+			break;
+		case 'n':
+			items = atol(optarg);
+			break;
+		case 'd':
+			dev = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: [-p producers] [-c consumers] [-n items_per_producer] [-d device]\n");
+			return -1;
+		}
+	}
+
+	if (producers < 1 || consumers < 1 || items < 1)
+	{
+		fprintf(stderr, "need at least one producer, consumer and item!\n");
+		return -1;
+	}
+
+	threads = malloc((producers + consumers) * sizeof(pthread_t));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < consumers; ++i)
+		pthread_create(&threads[i], 0, consume, 0);
+	for (i = 0; i < producers; ++i)
+		pthread_create(&threads[consumers + i], 0, produce, 0);
+
+	for (i = 0; i < producers; ++i)
+		pthread_join(threads[consumers + i], 0);
+
+	__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+
+	for (i = 0; i < consumers; ++i)
+		pthread_join(threads[i], 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	sec = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+	printf("producers: %d consumers: %d items: %ld time: %.3fs throughput: %.0f items/s\n",
+			producers, consumers, consumed, sec, consumed / sec);
+
+	free(threads);
+	return 0;
+}
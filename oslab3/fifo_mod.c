@@ -8,6 +8,14 @@
 #include <linux/cdev.h>			// cdev
 #include <linux/device.h>		// device struct in create_dev_node
 #include <linux/slab.h>			// kmalloc/kfree
+#include <linux/uio.h>			// iov_iter for read_iter/write_iter
+#include <linux/poll.h>			// poll_table
+#include <linux/math64.h>		// div64_u64
+#include <linux/hashtable.h>	// client table
+#include <linux/rculist.h>		// lockless client lookup
+#include <linux/hrtimer.h>		// sampler
+#include <linux/refcount.h>		// named queue users
+#include <linux/ctype.h>		// queue name check
 
 #include <asm/uaccess.h>		// user space memory access
 
@@ -19,226 +27,2378 @@ MODULE_LICENSE("GPL");
 
 #define DEV_NAME "deeds_fifo"
 
-// -------- globals ------------------------------------------------------
-// proc pointer for the virtual stats file
-static struct proc_dir_entry* proc_stats = 0;
+// named queues get the minors 1 to FIFO_MAX_QUEUES, /dev/deeds_fifo has 0
+#define FIFO_MAX_QUEUES 32
+#define FIFO_QUEUE_NAME_LEN 32
 
+// -------- globals ------------------------------------------------------
 // the actual fifo queue
 static struct fifo_dev fifo;
 
-// the kernel char device struct, used in create_dev_node 
-static struct cdev k_c_dev;
+// the kernel char device struct, used in create_dev_node 
+static struct cdev k_c_dev;
+
+// ptr to the dev class registered within the kernel
+static struct class* dev_class;
+
+// the acquired dev number (minor and major), dev_open checks for it
+static dev_t dev_no;
+
+// name of the LKM
+static char* mod_name = "deeds_fifo";
+
+// module parameter to configure the fifo size
+static size_t size = 0;
+module_param(size, ulong, 0);
+
+// module parameter to split the fifo into per-CPU shards of size items
+// each; trades the global order for throughput, see fifo_init_sharded
+static bool sharded = 0;
+module_param(sharded, bool, 0);
+
+// module parameters for priority levels (1 for none, not with sharded)
+// and their aging, see fifo_init_prio and fifo_set_aging
+static unsigned int levels = 1;
+module_param(levels, uint, 0);
+static unsigned int aging = 0;
+module_param(aging, uint, 0);
+
+// module parameter for the number of channels of tagged items,
+// 0 for none, see fifo_init_tagged
+static unsigned int channels = 0;
+module_param(channels, uint, 0);
+
+// module parameter to deliver every item to every consumer group,
+// see fifo_set_pubsub
+static bool pubsub = 0;
+module_param(pubsub, bool, 0);
+
+// module parameter to let the holder of the write mutex apply the writes
+// of all waiting producers at once (flat combining)
+static bool combine = 0;
+module_param(combine, bool, 0);
+
+// module parameter bounding how long (in us) a blocked reader or writer
+// polls for a counterpart that usually arrives that fast, 0 disables it
+static unsigned int spin_us = 10;
+module_param(spin_us, uint, 0);
+
+// module parameter to bound the memory of the queued items, 0 for none
+static size_t max_bytes = 0;
+module_param(max_bytes, ulong, 0);
+
+// module parameter for writes to a full fifo, see policy_names
+static char* overflow = "block";
+module_param(overflow, charp, 0);
+
+// module parameter, items queued longer than this are discarded, 0 for never
+static unsigned int ttl_ms = 0;
+module_param(ttl_ms, uint, 0);
+
+// module parameter for the file the fifo is saved to at unload and
+// refilled from at load, e.g. /var/lib/deeds_fifo.ckpt, 0 for none
+static char* checkpoint = 0;
+module_param(checkpoint, charp, 0);
+
+// module parameters for the spill file (tmpfs or disk), 0 for no
+// spilling, and the occupancy in percent above which new items go there
+static char* spill_path = 0;
+module_param(spill_path, charp, 0);
+static unsigned int spill_high = 90;
+module_param(spill_high, uint, 0);
+
+// indexed by enum fifo_policy
+static const char* const policy_names[] = { "block", "reject", "drop_oldest" };
+
+// overflow parsed by fifo_mod_init
+static enum fifo_policy policy;
+
+// directory of the stats files of the named queues
+static struct proc_dir_entry* proc_queues = 0;
+
+// module parameters of the occupancy sampler: interval in ms (0 disables
+// it) and number of samples kept in /proc/deeds_fifo_samples
+static unsigned int sample_ms = 100;
+module_param(sample_ms, uint, 0);
+static unsigned int sample_count = 600;
+module_param(sample_count, uint, 0);
+// -------- globals end --------------------------------------------------
+
+// -------- sampler ------------------------------------------------------
+
+/*
+ * One point of the occupancy time series, rates in items per second
+ * since the previous sample.
+ */
+struct fifo_sample {
+	u64 time;
+	size_t used;
+	unsigned long enq_rate;
+	unsigned long deq_rate;
+};
+
+// ring of the last sample_count samples, next is overwritten first
+static struct fifo_sample* samples;
+static unsigned int sample_next;
+static unsigned int sample_filled;
+static DEFINE_SPINLOCK(samples_lock);
+
+static struct hrtimer sampler;
+
+// counters at the previous sample, only touched by the timer
+static size_t last_insertitions;
+static size_t last_removals;
+static u64 last_sample;
+
+static unsigned long sample_rate(size_t now, size_t before, u64 dt)
+{
+	return dt ? div64_u64((u64)(now - before) * NSEC_PER_SEC, dt) : 0;
+}
+
+/*
+ * hrtimer callback, runs in interrupt context; fifo_counters takes no
+ * locks and skips the per-CPU and latency stats of fifo_snapshot
+ */
+static enum hrtimer_restart sample(struct hrtimer* timer)
+{
+	unsigned long flags;
+	struct fifo_snapshot snap;
+	struct fifo_sample point;
+	u64 now = ktime_get_ns();
+	u64 dt = now - last_sample;
+
+	fifo_counters(&fifo, &snap);
+
+	point.time = now;
+	point.used = snap.used;
+	point.enq_rate = sample_rate(snap.insertitions, last_insertitions, dt);
+	point.deq_rate = sample_rate(snap.removals, last_removals, dt);
+
+	last_insertitions = snap.insertitions;
+	last_removals = snap.removals;
+	last_sample = now;
+
+	spin_lock_irqsave(&samples_lock, flags);
+	samples[sample_next] = point;
+	sample_next = (sample_next + 1) % sample_count;
+	if (sample_filled < sample_count)
+		++sample_filled;
+	spin_unlock_irqrestore(&samples_lock, flags);
+
+	hrtimer_forward_now(timer, ms_to_ktime(sample_ms));
+	return HRTIMER_RESTART;
+}
+
+/*
+ * allocate the ring and start sampling, if sample_ms is set
+ *
+ * returns:
+ *	-ENOMEM if the ring could not be allocated
+ *	0 on success
+ */
+static int sampler_start(void)
+{
+	if (0 == sample_ms || 0 == sample_count)
+		return 0;
+
+	samples = kcalloc(sample_count, sizeof(struct fifo_sample), GFP_KERNEL);
+	if (0 == samples)
+		return -ENOMEM;
+
+	last_sample = ktime_get_ns();
+
+	hrtimer_init(&sampler, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sampler.function = sample;
+	hrtimer_start(&sampler, ms_to_ktime(sample_ms), HRTIMER_MODE_REL);
+	return 0;
+}
+
+static void sampler_stop(void)
+{
+	if (0 == samples)
+		return;
+
+	hrtimer_cancel(&sampler);
+	kfree(samples);
+	samples = 0;
+}
+// -------- sampler end --------------------------------------------------
+
+// -------- item records -------------------------------------------------
+
+#define CKPT_MAGIC 0x4b434644	// "DFCK"
+#define CKPT_VERSION 2
+
+// longest message accepted in a record
+#define CKPT_MAX_MSG (1 << 20)
+
+/*
+ * Checkpoint file layout in host byte order: a ckpt_header, then count
+ * times a ckpt_item followed by its len message bytes, no terminator.
+ * The spill file is a plain sequence of such records.
+ */
+struct ckpt_header {
+	u32 magic;
+	u32 version;
+	u64 seq_no;
+	u64 count;
+};
+
+struct ckpt_item {
+	u64 qid;
+	u64 time;
+	u64 create_ns;
+	u64 ttl_ns;
+	u32 prio;
+	u32 tag;
+	u32 len;
+	u32 pad;
+	char name[MODULE_NAME_LEN];		// producer, empty for user space
+};
+
+/*
+ * Write all len bytes of buf at *pos
+ *
+ * returns:
+ *	0 on success
+ *	EIO on a short write, else the error of kernel_write
+ */
+static int ckpt_write(struct file* file, const void* buf, size_t len, loff_t* pos)
+{
+	ssize_t ret = kernel_write(file, buf, len, pos);
+
+	if (ret < 0)
+		return -ret;
+	return ret == len ? 0 : EIO;
+}
+
+/*
+ * Read all len bytes of buf from *pos
+ *
+ * returns:
+ *	see ckpt_write
+ */
+static int ckpt_read(struct file* file, void* buf, size_t len, loff_t* pos)
+{
+	ssize_t ret = kernel_read(file, buf, len, pos);
+
+	if (ret < 0)
+		return -ret;
+	return ret == len ? 0 : EIO;
+}
+
+static void ckpt_fill(struct ckpt_item* ci, const struct data_item* di, const char* name)
+{
+	memset(ci, 0, sizeof(*ci));
+	if (name)
+		strlcpy(ci->name, name, MODULE_NAME_LEN);
+	ci->qid = di->qid;
+	ci->time = di->time;
+	ci->create_ns = di->create_ns;
+	ci->ttl_ns = di->ttl_ns;
+	ci->prio = di->prio;
+	ci->tag = di->tag;
+	ci->len = strlen(di->msg);
+}
+
+/*
+ * The producer name of a record as put and get take it
+ */
+static const char* ckpt_owner(const char* name)
+{
+	if (0 == name[0] || 0 == strcmp(name, FIFO_USER_NAME))
+		return 0;
+	return name;
+}
+
+/*
+ * The producer of an item of dev, as fifo_insert noted it
+ */
+static const char* ckpt_producer(struct fifo_dev* dev, const struct data_item* di)
+{
+	if (di->producer < 0 || di->producer >= READ_ONCE(dev->nr_producers))
+		return 0;
+	return ckpt_owner(dev->producer_names[di->producer]);
+}
+
+/*
+ * Write the record of di, produced by name, at *pos
+ *
+ * returns:
+ *	see ckpt_write
+ */
+static int ckpt_write_di(struct file* file, loff_t* pos, const struct data_item* di, const char* name)
+{
+	int err;
+	struct ckpt_item ci;
+
+	ckpt_fill(&ci, di, name);
+
+	err = ckpt_write(file, &ci, sizeof(ci), pos);
+	if (0 == err)
+		err = ckpt_write(file, di->msg, ci.len, pos);
+	return err;
+}
+
+/*
+ * Read the record at *pos into a new data_item
+ *
+ * @name: MODULE_NAME_LEN bytes for the producer name, see ckpt_owner
+ *
+ * returns:
+ *	ptr to the item
+ *	ERR_PTR(EINVAL) if the message is implausibly long, *pos is then
+ *		behind the record
+ *	ERR_PTR(ENOMEM)
+ *	ERR_PTR(see ckpt_read)
+ */
+static struct data_item* ckpt_read_di(struct file* file, loff_t* pos, char* name)
+{
+	int err;
+	char* msg;
+	struct ckpt_item ci;
+	struct data_item* di;
+
+	err = ckpt_read(file, &ci, sizeof(ci), pos);
+	if (err)
+		return ERR_PTR(-err);
+
+	if (ci.len > CKPT_MAX_MSG)
+	{
+		*pos += ci.len;
+		return ERR_PTR(-EINVAL);
+	}
+
+	memcpy(name, ci.name, MODULE_NAME_LEN);
+	name[MODULE_NAME_LEN - 1] = 0;
+
+	msg = kmalloc(ci.len + 1, GFP_KERNEL);
+	if (0 == msg)
+		return ERR_PTR(-ENOMEM);
+
+	err = ckpt_read(file, msg, ci.len, pos);
+	msg[ci.len] = 0;
+	di = err ? ERR_PTR(-err) : alloc_di(msg, ci.time);
+	kfree(msg);
+	if (IS_ERR(di))
+		return di;
+
+	// after a reboot the clock started over
+	di->create_ns = min(ci.create_ns, di->create_ns);
+	di->ttl_ns = ci.ttl_ns;
+	di->prio = ci.prio;
+	di->tag = ci.tag;
+	return di;
+}
+
+// -------- item records end ---------------------------------------------
+
+// -------- spill --------------------------------------------------------
+
+// records are appended to the spill file in batches of up to this size
+#define SPILL_BATCH PAGE_SIZE
+
+/*
+ * Above spill_high percent occupancy, put hands the new items of the
+ * default fifo to spill_file, a log of ckpt_item records. spill_work
+ * moves them back in order while the fifo is below the watermark.
+ * As long as the log holds items, all new items go there too, so the
+ * order is kept. All but spill_items are protected by spill_lock, but
+ * spill_work reads the records before spill_wpos without it.
+ */
+static struct file* spill_file = 0;
+static DEFINE_MUTEX(spill_lock);
+static struct work_struct spill_work;
+
+// the records between rpos and wpos are not read back yet
+static loff_t spill_rpos = 0;
+static loff_t spill_wpos = 0;
+
+// records not yet appended to the file
+static char* spill_batch = 0;
+static size_t spill_batch_len = 0;
+
+// read back, but the fifo was above the watermark again, and its producer
+static struct data_item* spill_held = 0;
+static char spill_held_name[MODULE_NAME_LEN];
+
+// items in the file, the batch and spill_held
+static atomic_long_t spill_items = ATOMIC_LONG_INIT(0);
+
+/*
+ * 1 if new items of dev go to the spill file
+ */
+static int spill_wanted(struct fifo_dev* dev)
+{
+	if (dev != &fifo || 0 == spill_file)
+		return 0;
+
+	return atomic_long_read(&spill_items)
+		|| fifo_used(dev) * 100 >= READ_ONCE(dev->size) * spill_high;
+}
+
+/*
+ * Let spill_work move items back, after a get made room
+ */
+static void spill_kick(void)
+{
+	if (atomic_long_read(&spill_items))
+		schedule_work(&spill_work);
+}
+
+/*
+ * Append the batch to the file. Needs spill_lock.
+ *
+ * returns:
+ *	see ckpt_write
+ */
+static int spill_flush(void)
+{
+	int err = ckpt_write(spill_file, spill_batch, spill_batch_len, &spill_wpos);
+
+	if (0 == err)
+		spill_batch_len = 0;
+	return err;
+}
+
+/*
+ * Take item into the spill file instead of the fifo, see spill_wanted.
+ * Items the fifo would never take are refused here, not on read back.
+ *
+ * @name: the producer, the item is put in its name on read back
+ * @nowait: do not wait for another writer of the spill file
+ *
+ * returns:
+ *	0 on success, item has been freed
+ *	EAGAIN if nowait and the spill file is busy
+ *	EBUSY if item has a put_async callback
+ *	EMSGSIZE if the message is too long for a record
+ *	see fifo_write_check, ckpt_write
+ */
+static int spill_put(struct data_item* item, const char* name, int nowait)
+{
+	int err;
+	struct ckpt_item ci;
+	size_t len;
+
+	// the callback would be lost with the record
+	if (item->ack)
+		return EBUSY;
+
+	err = fifo_write_check(&fifo, item);
+	if (err)
+		return err;
+
+	ckpt_fill(&ci, item, name);
+	if (ci.len > CKPT_MAX_MSG)
+		return EMSGSIZE;
+	len = sizeof(ci) + ci.len;
+
+	// a flush of the batch holds the lock for a write
+	if (nowait)
+	{
+		if (!mutex_trylock(&spill_lock))
+			return EAGAIN;
+	}
+	else
+		mutex_lock(&spill_lock);
+
+	if (spill_batch_len + len > SPILL_BATCH)
+		err = spill_flush();
+
+	// too long for a batch, straight to the file
+	if (0 == err && len > SPILL_BATCH)
+		err = ckpt_write_di(spill_file, &spill_wpos, item, name);
+	else if (0 == err)
+	{
+		memcpy(spill_batch + spill_batch_len, &ci, sizeof(ci));
+		memcpy(spill_batch + spill_batch_len + sizeof(ci), item->msg, ci.len);
+		spill_batch_len += len;
+	}
+
+	if (0 == err)
+		atomic_long_inc(&spill_items);
+
+	mutex_unlock(&spill_lock);
+
+	if (err)
+		return err;
+
+	free_di(item);
+
+	// the fifo may have drained before we got here
+	spill_kick();
+	return 0;
+}
+
+/*
+ * Move spilled items back into the fifo until it reaches the watermark
+ * again. The records in the file come first, then the batch.
+ * Only spill_work moves spill_rpos, and records before spill_wpos are
+ * not written any more, so they are read without spill_lock.
+ * A broken log is dropped.
+ */
+static void spill_refill(struct work_struct* work)
+{
+	int err = 0;
+	int put;
+	long lost;
+	loff_t end;
+
+	while (atomic_long_read(&spill_items) && fifo_used(&fifo) * 100 < READ_ONCE(fifo.size) * spill_high)
+	{
+		if (0 == spill_held)
+		{
+			mutex_lock(&spill_lock);
+			if (spill_rpos == spill_wpos)
+				err = spill_flush();
+			end = spill_wpos;
+			mutex_unlock(&spill_lock);
+
+			if (err || spill_rpos == end)
+				break;
+
+			spill_held = ckpt_read_di(spill_file, &spill_rpos, spill_held_name);
+			if (IS_ERR(spill_held))
+			{
+				err = -PTR_ERR(spill_held);
+				spill_held = 0;
+				break;
+			}
+		}
+
+		put = fifo_write_nowait(&fifo, spill_held, ckpt_owner(spill_held_name));
+		if (EAGAIN == put)
+			break;
+
+		// the fifo changed since, say a smaller budget, try the next one
+		if (put)
+		{
+			printk(KERN_INFO "--- %s: spilled item refused, error %d, lost!\n", mod_name, put);
+			free_di(spill_held);
+		}
+
+		spill_held = 0;
+		atomic_long_dec(&spill_items);
+	}
+
+	mutex_lock(&spill_lock);
+
+	if (err)
+	{
+		lost = atomic_long_xchg(&spill_items, 0);
+		spill_batch_len = 0;
+		printk(KERN_INFO "--- %s: spill read back failed, error %d, %ld items lost!\n", mod_name, err, lost);
+	}
+
+	// start the log over once it is read back
+	if (0 == atomic_long_read(&spill_items))
+		spill_rpos = spill_wpos = 0;
+
+	mutex_unlock(&spill_lock);
+}
+
+/*
+ * Open the spill file if spill_path is set
+ *
+ * returns:
+ *	0 on success
+ *	-ENOMEM
+ *	the error of filp_open
+ */
+static int spill_start(void)
+{
+	int err;
+
+	if (0 == spill_path)
+		return 0;
+
+	spill_high = clamp(spill_high, 1u, 100u);
+	INIT_WORK(&spill_work, spill_refill);
+
+	spill_batch = kmalloc(SPILL_BATCH, GFP_KERNEL);
+	if (0 == spill_batch)
+		return -ENOMEM;
+
+	spill_file = filp_open(spill_path, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+	if (IS_ERR(spill_file))
+	{
+		err = PTR_ERR(spill_file);
+		spill_file = 0;
+		kfree(spill_batch);
+		spill_batch = 0;
+		return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Append the spilled items to the checkpoint file at *pos, in order.
+ * Stops the read back, for unload.
+ *
+ * @count: incremented per item written
+ *
+ * returns:
+ *	see ckpt_write
+ */
+static int spill_save(struct file* file, loff_t* pos, u64* count)
+{
+	int err = 0;
+	struct data_item* di;
+	char name[MODULE_NAME_LEN];
+
+	if (0 == spill_file)
+		return 0;
+
+	cancel_work_sync(&spill_work);
+
+	mutex_lock(&spill_lock);
+
+	if (spill_held)
+	{
+		err = ckpt_write_di(file, pos, spill_held, ckpt_owner(spill_held_name));
+		if (0 == err)
+			++*count;
+	}
+
+	if (0 == err)
+		err = spill_flush();
+
+	while (0 == err && spill_rpos < spill_wpos)
+	{
+		di = ckpt_read_di(spill_file, &spill_rpos, name);
+		if (IS_ERR(di))
+		{
+			err = -PTR_ERR(di);
+			break;
+		}
+
+		err = ckpt_write_di(file, pos, di, ckpt_owner(name));
+		free_di(di);
+		if (0 == err)
+			++*count;
+	}
+
+	mutex_unlock(&spill_lock);
+	return err;
+}
+
+static void spill_stop(void)
+{
+	if (0 == spill_file)
+		return;
+
+	cancel_work_sync(&spill_work);
+
+	if (spill_held)
+		free_di(spill_held);
+	spill_held = 0;
+
+	filp_close(spill_file, 0);
+	spill_file = 0;
+
+	kfree(spill_batch);
+	spill_batch = 0;
+}
+
+// -------- spill end ----------------------------------------------------
+
+// -------- checkpoint ---------------------------------------------------
+
+// records checkpoint_load could not restore, kept at the file start
+static u64 ckpt_tail_count = 0;
+static loff_t ckpt_tail_end = 0;
+
+// set if they could not be kept, the file is then left as it is
+static int ckpt_frozen = 0;
+
+/*
+ * Move the records from start to the end of the file right behind the
+ * header, which then counts count records, see checkpoint_load
+ *
+ * returns:
+ *	0 on success
+ *	see ckpt_write otherwise
+ */
+static int ckpt_keep_tail(struct file* file, struct ckpt_header* h, loff_t start, u64 count)
+{
+	int err;
+	ssize_t n;
+	char buf[256];
+	loff_t pos = sizeof(*h);
+
+	// the write position never passes the read position
+	while ((n = kernel_read(file, buf, sizeof(buf), &start)) > 0)
+	{
+		err = ckpt_write(file, buf, n, &pos);
+		if (err)
+			return err;
+	}
+	if (n < 0)
+		return -n;
+
+	h->count = count;
+	ckpt_tail_end = pos;
+	pos = 0;
+	err = ckpt_write(file, h, sizeof(*h), &pos);
+	if (0 == err)
+		ckpt_tail_count = count;
+	return err;
+}
+
+/*
+ * Save the items of dev in peek order to the checkpoint file, then the
+ * spilled ones, once no client is left. The header is written last, so
+ * an interrupted save leaves a file checkpoint_load ignores, or one with
+ * just the records the last load left behind. Those come first.
+ */
+static void checkpoint_save(struct fifo_dev* dev)
+{
+	int err;
+	u64 n = 0;
+	u64 queued = 0;
+	u64 skipped = 0;
+	struct file* file;
+	struct data_item* di;
+	struct fifo_snapshot c;
+	struct ckpt_header h = { CKPT_MAGIC, CKPT_VERSION, 0, ckpt_tail_count };
+	loff_t pos = ckpt_tail_count ? ckpt_tail_end : sizeof(h);
+
+	if (0 == checkpoint)
+		return;
+
+	if (ckpt_frozen)
+	{
+		printk(KERN_INFO "--- %s: %s holds unrestored items, not saved!\n", mod_name, checkpoint);
+		return;
+	}
+
+	file = filp_open(checkpoint, O_WRONLY | O_CREAT | (ckpt_tail_count ? 0 : O_TRUNC), 0600);
+	if (IS_ERR(file))
+	{
+		printk(KERN_INFO "--- %s: could not open checkpoint %s, error %ld!\n", mod_name, checkpoint, PTR_ERR(file));
+		return;
+	}
+
+	fifo_snapshot(dev, &c);
+
+	for (; !IS_ERR(di = fifo_peek(dev, n)); ++n)
+	{
+		// checkpoint_load would refuse it
+		if (strlen(di->msg) > CKPT_MAX_MSG)
+		{
+			free_di(di);
+			++skipped;
+			continue;
+		}
+
+		err = ckpt_write_di(file, &pos, di, ckpt_producer(dev, di));
+		free_di(di);
+		if (err)
+			goto out;
+
+		++queued;
+	}
+
+	if (skipped)
+		printk(KERN_INFO "--- %s: %llu items too long for %s, not saved!\n", mod_name, skipped, checkpoint);
+	h.count += queued;
+
+	// spilled items get their qids after the queued ones, the kept
+	// records take over the qids of the oldest queued ones
+	h.seq_no = c.seq_no - queued;
+	err = spill_save(file, &pos, &h.count);
+	if (err)
+		goto out;
+	h.seq_no += h.count;
+
+	pos = 0;
+	err = ckpt_write(file, &h, sizeof(h), &pos);
+
+out:
+	filp_close(file, 0);
+
+	if (err)
+		printk(KERN_INFO "--- %s: checkpoint write failed, error %d!\n", mod_name, err);
+	else
+		printk(KERN_INFO "--- %s: %llu items saved to %s\n", mod_name, h.count, checkpoint);
+}
+
+/*
+ * Refill dev from the checkpoint file before it is used. The qids of
+ * new items continue where the saved fifo stopped; the items are
+ * queued anew, so their ttl starts over. Items beyond the watermark
+ * go to the spill file. The file is emptied once loaded, so a crash
+ * does not bring back items consumed meanwhile. If not all items fit,
+ * the file keeps the rest and checkpoint_save adds to it. Records that
+ * would never load, or that can not be read, are dropped.
+ */
+static void checkpoint_load(struct fifo_dev* dev)
+{
+	int err;
+	u64 i;
+	u64 dropped = 0;
+	int broken = 0;
+	struct file* file;
+	struct data_item* di;
+	struct ckpt_header h;
+	loff_t pos = 0;
+	loff_t start;
+	char name[MODULE_NAME_LEN];
+
+	if (0 == checkpoint)
+		return;
+
+	// no checkpoint yet
+	file = filp_open(checkpoint, O_RDWR, 0);
+	if (IS_ERR(file))
+		return;
+
+	// empty after the last load
+	if (ckpt_read(file, &h, sizeof(h), &pos))
+	{
+		filp_close(file, 0);
+		return;
+	}
+
+	if (h.magic != CKPT_MAGIC || h.version != CKPT_VERSION)
+	{
+		printk(KERN_INFO "--- %s: %s is no checkpoint, ignored!\n", mod_name, checkpoint);
+		filp_close(file, 0);
+		return;
+	}
+
+	// the saved items get their qids back if they fit
+	fifo_set_seq_no(dev, h.seq_no - h.count);
+
+	for (err = 0, i = 0; i < h.count; ++i)
+	{
+		start = pos;
+		di = ckpt_read_di(file, &pos, name);
+		if (IS_ERR(di))
+			err = -PTR_ERR(di);
+		else if (spill_wanted(dev))
+			err = spill_put(di, ckpt_owner(name), 0);
+		else
+			err = fifo_write_nowait(dev, di, ckpt_owner(name));
+
+		if (err && !IS_ERR(di))
+			free_di(di);
+
+		// records that would never load are dropped, not kept
+		if (EINVAL == err || EMSGSIZE == err)
+		{
+			printk(KERN_INFO "--- %s: item %llu of %s refused, error %d, dropped!\n", mod_name, i, checkpoint, err);
+			++dropped;
+			err = 0;
+		}
+		if (err)
+		{
+			broken = IS_ERR(di) && err != ENOMEM;
+			break;
+		}
+	}
+
+	fifo_set_seq_no(dev, h.seq_no);
+
+	// a short or unreadable record, the rest can not be read either;
+	// the others, like a full fifo, keep the rest for the next load
+	if (broken)
+	{
+		printk(KERN_INFO "--- %s: %s is broken at item %llu, error %d, %llu items lost!\n", mod_name, checkpoint, i, err, h.count - i);
+		dropped += h.count - i;
+		i = h.count;
+		err = 0;
+	}
+
+	if (0 == err)
+	{
+		filp_close(file, 0);
+		printk(KERN_INFO "--- %s: restored %llu items from %s\n", mod_name, i - dropped, checkpoint);
+
+		file = filp_open(checkpoint, O_WRONLY | O_TRUNC, 0);
+		if (!IS_ERR(file))
+			filp_close(file, 0);
+		return;
+	}
+
+	printk(KERN_INFO "--- %s: restored %llu of %llu items from %s, error %d!\n", mod_name, i - dropped, h.count, checkpoint, err);
+
+	// a failed move leaves a header that still counts all records
+	err = ckpt_keep_tail(file, &h, start, h.count - i);
+	filp_close(file, 0);
+
+	if (err)
+	{
+		ckpt_frozen = 1;
+		printk(KERN_INFO "--- %s: could not keep the rest in %s, error %d, it is not saved over!\n", mod_name, checkpoint, err);
+	}
+	else
+		printk(KERN_INFO "--- %s: %llu items kept in %s\n", mod_name, ckpt_tail_count, checkpoint);
+}
+
+// -------- checkpoint end -----------------------------------------------
+
+// -------- client accounting --------------------------------------------
+
+/*
+ * Activity of one caller of put/get, keyed by the name it passes.
+ * Entries are only added while the module is loaded, so they can be
+ * looked up without locking.
+ */
+struct fifo_client {
+	struct hlist_node node;
+	char name[MODULE_NAME_LEN];
+
+	atomic_long_t produced;
+	atomic_long_t consumed;
+	atomic64_t bytes_in;
+	atomic64_t bytes_out;
+	atomic64_t blocked_ns;		// time spent inside put/get
+	u64 last_active;
+};
+
+static DEFINE_HASHTABLE(clients, 4);
+
+// serializes additions to clients
+static DEFINE_SPINLOCK(clients_lock);
+
+static struct fifo_client* client_find(const char* name, u32 key)
+{
+	struct fifo_client* c;
+
+	hash_for_each_possible_rcu(clients, c, node, key)
+		if (0 == strcmp(c->name, name))
+			return c;
+	return 0;
+}
+
+/*
+ * look up or add the entry for name, 0 for user space
+ *
+ * returns:
+ *	the entry or 0 if no memory was left
+ */
+static struct fifo_client* client_get(const char* name)
+{
+	u32 key;
+	struct fifo_client* c;
+	struct fifo_client* added;
+
+	if (0 == name)
+		name = FIFO_USER_NAME;
+	key = full_name_hash(0, name, strlen(name));
+
+	rcu_read_lock();
+	c = client_find(name, key);
+	rcu_read_unlock();
+	if (c)
+		return c;
+
+	added = kzalloc(sizeof(struct fifo_client), GFP_KERNEL);
+	if (0 == added)
+		return 0;
+	strlcpy(added->name, name, MODULE_NAME_LEN);
+
+	spin_lock(&clients_lock);
+	c = client_find(name, key);
+	if (0 == c)
+	{
+		hash_add_rcu(clients, &added->node, key);
+		c = added;
+		added = 0;
+	}
+	spin_unlock(&clients_lock);
+
+	kfree(added);
+	return c;
+}
+
+/*
+ * account one put (produced) or get of an item with msg_bytes of payload
+ */
+static void client_account(const char* name, int produced, size_t msg_bytes, u64 start)
+{
+	u64 now = ktime_get_ns();
+	struct fifo_client* c = client_get(name);
+
+	if (0 == c)
+		return;
+
+	if (produced)
+	{
+		atomic_long_inc(&c->produced);
+		atomic64_add(msg_bytes, &c->bytes_in);
+	}
+	else
+	{
+		atomic_long_inc(&c->consumed);
+		atomic64_add(msg_bytes, &c->bytes_out);
+	}
+
+	atomic64_add(now - start, &c->blocked_ns);
+	WRITE_ONCE(c->last_active, now);
+}
+
+static void clients_free(void)
+{
+	int bkt;
+	struct hlist_node* tmp;
+	struct fifo_client* c;
+
+	hash_for_each_safe(clients, bkt, tmp, c, node)
+	{
+		hash_del(&c->node);
+		kfree(c);
+	}
+}
+// -------- client accounting end ----------------------------------------
+
+// -------- exported functions, fifo access ------------------------------
+
+/*
+ * put, optionally without waiting for space, accounted to name
+ *
+ * returns:
+ *	see fifo_write, fifo_write_nowait
+ */
+static int fifo_mod_put(struct fifo_dev* dev, struct data_item* input, const char* name, int nowait)
+{
+	int err;
+	u64 start = ktime_get_ns();
+	// input belongs to the consumer once it is queued
+	size_t msg_bytes = strlen(input->msg) + 1;
+
+	if (spill_wanted(dev))
+		err = spill_put(input, name, nowait);
+	else if (nowait)
+		err = fifo_write_nowait(dev, input, name);
+	else
+		err = fifo_write(dev, input, name);
+
+	if (0 == err)
+		client_account(name, 1, msg_bytes, start);
+	return err;
+}
+
+/*
+ * get, optionally without waiting for an item, accounted to name
+ *
+ * returns:
+ *	see fifo_read, fifo_read_nowait
+ */
+static struct data_item* fifo_mod_get(struct fifo_dev* dev, const char* name, int nowait)
+{
+	struct data_item* di;
+	u64 start = ktime_get_ns();
+
+	if (nowait)
+		di = fifo_read_nowait(dev, name);
+	else
+		di = fifo_read(dev, name);
+
+	if (IS_ERR(di))
+		return di;
+
+	client_account(name, 0, strlen(di->msg) + 1, start);
+	if (dev == &fifo)
+		spill_kick();
+	return di;
+}
+
+/*
+ * If space is available, the given input is inserted at fifo.end
+ *
+ * @input: the data item to be insterted
+ * @name: 	name of the calling lkm (obtained from THISMODULE),
+ * 			or 0 for user space.
+ * 
+ * returns:
+ *	0 on success
+ *	see fifo_write
+ */
+static int put(struct data_item* input, const char* name)
+{
+	return fifo_mod_put(&fifo, input, name, 0);
+}
+EXPORT_SYMBOL(put);
+
+/*
+ * If the fifo is not empty, output will be the item at fifo.front
+ *
+ * @name: 	name of the calling lkm (obtained from THISMODULE),
+ * 			or 0 for user space.
+ * 
+ * returns:
+ *	ptr to a data_item on success
+ *	ERR_PTR(see fifo_read)
+ */
+struct data_item* get(const char* name)
+{
+	return fifo_mod_get(&fifo, name, 0);
+}
+EXPORT_SYMBOL(get);
+
+/*
+ * get without waiting for an item
+ *
+ * returns:
+ *	see fifo_read_nowait
+ */
+struct data_item* get_nowait(const char* name)
+{
+	return fifo_mod_get(&fifo, name, 1);
+}
+EXPORT_SYMBOL(get_nowait);
+
+/*
+ * put with the priority level prio, see fifo_init_prio
+ *
+ * returns:
+ *	see put
+ */
+int put_prio(struct data_item* input, unsigned int prio, const char* name)
+{
+	input->prio = prio;
+	return fifo_mod_put(&fifo, input, name, 0);
+}
+EXPORT_SYMBOL(put_prio);
+
+/*
+ * put that never blocks. callback(ctx, qid, status) runs in workqueue
+ * context once a consumer has taken input or it has been dropped, see
+ * fifo_set_ack. The module of callback stays loaded while it is due.
+ *
+ * returns:
+ *	0 if input was queued
+ *	EBUSY if the fifo is full, locked or spilling, input still belongs to the caller
+ *	ENOMEM if the callback could not be allocated
+ *	ENODEV if the module of callback is being unloaded
+ *	see fifo_write_nowait
+ */
+int put_async(struct data_item* input, const char* name, fifo_ack_fn callback, void* ctx)
+{
+	int err = fifo_set_ack(input, callback, ctx);
+
+	if (err)
+		return err;
+
+	err = fifo_mod_put(&fifo, input, name, 1);
+	if (0 == err)
+		return 0;
+
+	fifo_set_ack(input, 0, 0);
+	return (EAGAIN == err || ENOSPC == err) ? EBUSY : err;
+}
+EXPORT_SYMBOL(put_async);
+
+/*
+ * put into the channel tag, see fifo_init_tagged
+ *
+ * returns:
+ *	see put
+ *	EINVAL if there is no channel tag
+ */
+int put_tagged(struct data_item* input, unsigned int tag, const char* name)
+{
+	input->tag = tag;
+	return fifo_mod_put(&fifo, input, name, 0);
+}
+EXPORT_SYMBOL(put_tagged);
+
+/*
+ * get the next item of the channel tag, skipping the items of all
+ * other channels
+ *
+ * returns:
+ *	see fifo_read_tag
+ */
+struct data_item* get_filtered(unsigned int tag, const char* name)
+{
+	u64 start = ktime_get_ns();
+	struct data_item* di = fifo_read_tag(&fifo, tag, name);
+
+	if (IS_ERR(di))
+		return di;
+
+	client_account(name, 0, strlen(di->msg) + 1, start);
+	spill_kick();
+	return di;
+}
+EXPORT_SYMBOL(get_filtered);
+
+/*
+ * Look at the item pos places behind fifo.front without removing it
+ *
+ * returns:
+ *	see fifo_peek, drop the item with free_di
+ */
+struct data_item* peek(size_t pos)
+{
+	return fifo_peek(&fifo, pos);
+}
+EXPORT_SYMBOL(peek);
+
+int request_kill_read(const char* name)
+{
+	return fifo_request_kill_read(&fifo, name);
+}
+EXPORT_SYMBOL(request_kill_read);
+
+int request_kill_write(const char* name)
+{
+	return fifo_request_kill_write(&fifo, name);
+}
+EXPORT_SYMBOL(request_kill_write);
+
+int request_kill_read_tag(unsigned int tag, const char* name)
+{
+	return fifo_request_kill_read_tag(&fifo, tag, name);
+}
+EXPORT_SYMBOL(request_kill_read_tag);
+
+/*
+ * Have callback(ctx) called when an item arrives for the consumer name,
+ * instead of blocking in get, see fifo_notify_add
+ *
+ * returns:
+ *	see fifo_notify_add
+ */
+int register_notify(const char* name, fifo_notify_fn callback, void* ctx)
+{
+	return fifo_notify_add(&fifo, name, callback, ctx);
+}
+EXPORT_SYMBOL(register_notify);
+
+/*
+ * After get_nowait came back empty: call back on the next item,
+ * see fifo_notify_arm
+ */
+void arm_notify(const char* name)
+{
+	fifo_notify_arm(&fifo, name);
+}
+EXPORT_SYMBOL(arm_notify);
+
+void unregister_notify(const char* name)
+{
+	fifo_notify_del(&fifo, name);
+}
+EXPORT_SYMBOL(unregister_notify);
+// -------- exported functions, fifo access end ------------------------------
+
+// -------- named queues -------------------------------------------------
+
+/*
+ * A queue created through /proc/deeds_fifo_ctl, with its own device node
+ * /dev/deeds_fifo_<name> and stats file /proc/deeds_fifo_queues/<name>.
+ * users is 1 while nobody uses the queue; every put/get on it and every
+ * open file holds one more. A queue is only deleted while unused.
+ */
+struct fifo_queue {
+	struct hlist_node node;
+	char name[FIFO_QUEUE_NAME_LEN];
+	refcount_t users;
+
+	struct fifo_dev dev;
+
+	unsigned int minor;
+	struct cdev* cdev;
+	struct proc_dir_entry* stats;
+};
+
+// named queues by name, additions and removals under queues_lock
+static DEFINE_HASHTABLE(queues, 5);
+
+// named queues by minor, index 0 stays unused
+static struct fifo_queue __rcu* queue_minors[FIFO_MAX_QUEUES + 1];
+
+// serializes creation and deletion of named queues
+static DEFINE_MUTEX(queues_lock);
+
+static u32 queue_key(const char* name)
+{
+	return full_name_hash(0, name, strlen(name));
+}
+
+/*
+ * needs rcu_read_lock or queues_lock
+ */
+static struct fifo_queue* queue_find(const char* name)
+{
+	struct fifo_queue* q;
+
+	hash_for_each_possible_rcu(queues, q, node, queue_key(name))
+		if (0 == strcmp(q->name, name))
+			return q;
+	return 0;
+}
+
+/*
+ * look up the queue name and become one of its users
+ *
+ * returns:
+ *	the queue, to be given back with queue_put
+ *	0 if there is no such queue or it is being deleted
+ */
+static struct fifo_queue* queue_get(const char* name)
+{
+	struct fifo_queue* q;
+
+	rcu_read_lock();
+	q = queue_find(name);
+	if (q && !refcount_inc_not_zero(&q->users))
+		q = 0;
+	rcu_read_unlock();
+
+	return q;
+}
+
+/*
+ * see queue_get
+ */
+static struct fifo_queue* queue_get_minor(unsigned int minor)
+{
+	struct fifo_queue* q;
+
+	if (0 == minor || minor > FIFO_MAX_QUEUES)
+		return 0;
+
+	rcu_read_lock();
+	q = rcu_dereference(queue_minors[minor]);
+	if (q && !refcount_inc_not_zero(&q->users))
+		q = 0;
+	rcu_read_unlock();
+
+	return q;
+}
+
+static void queue_put(struct fifo_queue* q)
+{
+	refcount_dec(&q->users);
+}
+
+/*
+ * put into the named queue qname
+ *
+ * returns:
+ *	ENOENT if there is no queue qname
+ *	see put
+ */
+int put_named(const char* qname, struct data_item* input, const char* name)
+{
+	int err;
+	struct fifo_queue* q = queue_get(qname);
+
+	if (0 == q)
+		return ENOENT;
+
+	err = fifo_mod_put(&q->dev, input, name, 0);
+	queue_put(q);
+	return err;
+}
+EXPORT_SYMBOL(put_named);
+
+/*
+ * get from the named queue qname
+ *
+ * returns:
+ *	ERR_PTR(-ENOENT) if there is no queue qname
+ *	see get
+ */
+struct data_item* get_named(const char* qname, const char* name)
+{
+	struct data_item* di;
+	struct fifo_queue* q = queue_get(qname);
+
+	if (0 == q)
+		return ERR_PTR(-ENOENT);
+
+	di = fifo_mod_get(&q->dev, name, 0);
+	queue_put(q);
+	return di;
+}
+EXPORT_SYMBOL(get_named);
+
+int request_kill_read_named(const char* qname, const char* name)
+{
+	int err;
+	struct fifo_queue* q = queue_get(qname);
+
+	if (0 == q)
+		return ENOENT;
+
+	err = fifo_request_kill_read(&q->dev, name);
+	queue_put(q);
+	return err;
+}
+EXPORT_SYMBOL(request_kill_read_named);
+
+int request_kill_write_named(const char* qname, const char* name)
+{
+	int err;
+	struct fifo_queue* q = queue_get(qname);
+
+	if (0 == q)
+		return ENOENT;
+
+	err = fifo_request_kill_write(&q->dev, name);
+	queue_put(q);
+	return err;
+}
+EXPORT_SYMBOL(request_kill_write_named);
+// -------- named queues end ---------------------------------------------
+
+// -------- user space access --------------------------------------------
+/*
+ * checks if the right device trys to access the queue,
+ * the default fifo or a named queue, which is in use until dev_release
+ *
+ * returns:
+ *	-ENODEV if the opening device node has the wrong major or minor number
+ * 	0 on success
+ */
+static int dev_open(struct inode* inode, struct file* filp)
+{
+	struct fifo_queue* q = 0;
+
+	if (imajor(inode) != MAJOR(dev_no) ||
+		(iminor(inode) != MINOR(dev_no) && 0 == (q = queue_get_minor(iminor(inode)))))
+	{
+		printk(KERN_INFO "---- %s: dev_open failed, wrong device number(s)!\n", mod_name);
+		return -ENODEV;
+	}
+
+	filp->private_data = q ? &q->dev : &fifo;
+
+	// dev_read_iter/dev_write_iter honour IOCB_NOWAIT
+	filp->f_mode |= FMODE_NOWAIT;
+
+	return 0;
+}
+
+/*
+ * true if the caller asked not to be put to sleep,
+ * either by O_NONBLOCK or by IOCB_NOWAIT (io_uring, RWF_NOWAIT)
+ */
+static int dev_nowait(struct kiocb* iocb)
+{
+	return (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+}
+
+/*
+ * Implements user read.
+ * Forces reading of one data_item by returning 0 on any file offset > 0.
+ * Asynchronous callers (io_uring) should pass an explicit offset of 0.
+ *
+ * returns:
+ * 	number of read bytes on success, 0 on second try
+ * 	-EAGAIN if the fifo is empty and the caller must not block
+ * 	-EFAULT if copy_to_iter failed
+ *	see get
+ */
+static ssize_t dev_read_iter(struct kiocb* iocb, struct iov_iter* to)
+{
+	char* return_str;
+	struct data_item* di;
+	size_t count = iov_iter_count(to);
+	ssize_t real_count = 0;
+
+	// only one read!
+	if (iocb->ki_pos != 0 || 0 == count)
+		return 0;
+
+	// allocate first, a dequeued item must not be lost
+	return_str = kmalloc(count * sizeof(char), GFP_KERNEL);
+	if (0 == return_str)
+		return -ENOMEM;
+
+	// read from fifo
+	di = fifo_mod_get(iocb->ki_filp->private_data, 0, dev_nowait(iocb));
+	if (IS_ERR(di))
+	{
+		kfree(return_str);
+		return PTR_ERR(di);
+	}
+
+	real_count = scnprintf(return_str, count, "[%lu][%llu] %s",
+							di->qid, di->time, di->msg);
+
+	// free the memory not needed anymore
+	free_di(di);
+
+	if (copy_to_iter(return_str, real_count, to) != real_count)
+	{
+		printk(KERN_INFO "--- %s: dev_read; copy_to_iter failed!\n", mod_name);
+		real_count = -EFAULT;
+	}
+	else
+		iocb->ki_pos = real_count;
+
+	kfree(return_str);
+	return real_count;
+}
+
+/*
+ * implements user write
+ *
+ * returns:
+ * 	count on success
+ * 	-EAGAIN if the fifo is full and the caller must not block
+ * 	-EMSGSIZE if the message alone exceeds max_bytes
+ * 	-EFAULT if copy_from_iter failed
+ *	-EINVAL if contents of buf are malformed
+ */
+static ssize_t dev_write_iter(struct kiocb* iocb, struct iov_iter* from)
+{
+	ssize_t ret;
+	struct data_item* di;
+	size_t count = iov_iter_count(from);
+	char* str = kmalloc((count + 1) * sizeof(char), GFP_KERNEL);
+
+	if (0 == str)
+		return -ENOMEM;
+
+	if (copy_from_iter(str, count, from) != count)
+	{
+		printk(KERN_INFO "--- %s: dev_write; copy_from_iter failed!\n", mod_name);
+		ret = -EFAULT;
+		goto out;
+	}
+
+	// force zero termination
+	str[count] = '\0'; 
+
+	// get a data_item struct
+	di = alloc_di_str(str);
+	if (IS_ERR(di))
+	{
+		ret = PTR_ERR(di);
+		goto out;
+	}
+
+	// write to fifo
+	ret = -fifo_mod_put(iocb->ki_filp->private_data, di, 0, dev_nowait(iocb));
+	if (0 == ret)
+		ret = count;
+	else
+		free_di(di);
+
+out:
+	kfree(str);
+	return ret;
+}
+
+/*
+ * Readiness for poll/select/epoll and io_uring's poll based retry.
+ * The semaphore counts are read without locking, like stats_read does.
+ */
+static unsigned int dev_poll(struct file* filp, poll_table* wait)
+{
+	unsigned int mask = 0;
+	struct fifo_dev* dev = filp->private_data;
+
+	poll_wait(filp, &dev->poll_wait, wait);
+
+	if (fifo_readable(dev, 0))
+		mask |= POLLIN | POLLRDNORM;
+	if (fifo_writable(dev))
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
+}
+
+static int dev_release(struct inode* inode, struct file* filp)
+{
+	struct fifo_dev* dev = filp->private_data;
+
+	if (dev != &fifo)
+		queue_put(container_of(dev, struct fifo_queue, dev));
+	return 0;
+}
+
+/* 
+ * The file ops for user space fifo access
+ */
+static struct file_operations dev_fops = {
+	.owner =		THIS_MODULE,
+	.open =			dev_open,
+	.read_iter =	dev_read_iter,
+	.write_iter =	dev_write_iter,
+	.poll =			dev_poll,
+	.release =		dev_release,
+};
+// -------- user space access end ----------------------------------------
+
+// -------- stats --------------------------------------------------------
+/*
+ * print the log2 histogram h, one line per non-empty bucket
+ */
+static void stats_show_hist(struct seq_file* seq, const char* label, const struct fifo_hist* h)
+{
+	unsigned int b;
+
+	seq_printf(seq, "%s: count: %lu avg: %llu ns max: %llu ns\n",
+				label, h->count, h->count ? div64_u64(h->sum, h->count) : 0, h->max);
+
+	for (b = 0; b < FIFO_HIST_BUCKETS; ++b)
+	{
+		if (0 == h->bucket[b])
+			continue;
+
+		if (b == FIFO_HIST_BUCKETS - 1)
+			seq_printf(seq, "\t>= %llu ns: %lu\n", 1ULL << (b - 1), h->bucket[b]);
+		else
+			seq_printf(seq, "\t< %llu ns: %lu\n", 1ULL << b, h->bucket[b]);
+	}
+}
+
+static void stats_show_wait(struct seq_file* seq, const char* sem, const struct fifo_wait_stats* ws)
+{
+	seq_printf(seq, "waits on %s: %lu (spun: %lu) total: %llu ns max: %llu ns\n",
+				sem, ws->waits, ws->spun, ws->total_ns, ws->max_ns);
+}
+
+static void stats_show_hold(struct seq_file* seq, const char* lock, const struct fifo_hold_stats* hs)
+{
+	seq_printf(seq, "%s lock held: %lu times total: %llu ns max: %llu ns\n",
+				lock, hs->count, hs->total_ns, hs->max_ns);
+}
+
+/*
+ * counters and queueing delay of every priority level or channel,
+ * highest first
+ */
+static void stats_show_levels(struct seq_file* seq, struct fifo_dev* dev, struct fifo_hist* hist)
+{
+	unsigned int l;
+	struct fifo_snapshot c;
+	struct fifo_dev* level;
+	const char* label = dev->prio ? "level" : "channel";
+
+	if (dev->prio)
+		seq_printf(seq, "levels: %u aging: %u\n", dev->nr_shards, dev->age);
+	else
+		seq_printf(seq, "channels: %u\n", dev->nr_shards);
+
+	for (l = dev->nr_shards; l-- > 0;)
+	{
+		level = dev->shards + l;
+
+		fifo_snapshot(level, &c);
+		fifo_latency(level, hist, hist + 1);
+
+		seq_printf(seq, "\n%s %u: used: %lu peak used: %lu insertitions: %lu removals: %lu\n",
+					label, l, c.used, c.peak, c.insertitions, c.removals);
+		stats_show_hist(seq, "queueing delay", hist);
+	}
+	seq_printf(seq, "\n");
+}
+
+/*
+ * progress of every consumer group in publish/subscribe mode,
+ * read without the lock like producer_names
+ */
+static void stats_show_groups(struct seq_file* seq, struct fifo_dev* dev, const struct fifo_snapshot* c)
+{
+	int i;
+	struct fifo_group* g;
+
+	seq_printf(seq, "consumer groups, max lag: %lu\n", c->max_lag);
+
+	for (i = 0; i < FIFO_MAX_GROUPS; ++i)
+	{
+		g = dev->groups + i;
+		if (0 == READ_ONCE(g->name[0]))
+			continue;
+
+		seq_printf(seq, "%s: consumed: %lu lag: %lu\n", g->name, READ_ONCE(g->consumed),
+					c->insertitions - min(READ_ONCE(g->next), c->insertitions));
+	}
+	seq_printf(seq, "\n");
+}
+
+/*
+ * The stats of the device given to single_open, the default fifo or
+ * a named queue
+ */
+static int stats_read(struct seq_file* seq, void* v)
+{
+	int p;
+	u64 avg_used;
+	struct fifo_hist* hist;
+	struct fifo_snapshot c;
+	struct fifo_dev* dev = seq->private;
+	int relative_usage;
+
+	fifo_snapshot(dev, &c);
+	relative_usage = (c.used*100)/c.size;
+
+	seq_printf(seq, "size: %lu\nused: %lu\nempty: %lu\nusage percent: %d\n\ncurrent seq_no: %llu\ninsertitions: %lu\nremovals: %lu\n\naccess count: %lu\n\n",
+				c.size, c.used, c.size - c.used, relative_usage, c.seq_no, c.insertitions, c.removals, module_refcount(THIS_MODULE));
+
+	if (dev->shards && !dev->prio && !dev->tagged)
+		seq_printf(seq, "shards: %u\n\n", dev->nr_shards);
+
+	if (c.max_bytes)
+		seq_printf(seq, "bytes: %lu\nmax bytes: %lu\n\n", c.bytes, c.max_bytes);
+
+	seq_printf(seq, "overflow policy: %s\nrejected: %lu\ndropped: %lu\nexpired: %lu\n\n",
+				policy_names[dev->policy], c.rejected, c.dropped, c.expired);
+
+	if (dev == &fifo && spill_file)
+		seq_printf(seq, "spilled: %ld\nspill watermark percent: %u\n\n", atomic_long_read(&spill_items), spill_high);
+
+	if (dev->pubsub)
+		stats_show_groups(seq, dev, &c);
+
+	stats_show_wait(seq, "full", &c.full);
+	stats_show_wait(seq, "empty", &c.empty);
+	stats_show_hold(seq, "write", &c.write);
+	stats_show_hold(seq, "read", &c.read);
+
+	// time-averaged occupancy with two decimals
+	avg_used = c.elapsed_ns ? div64_u64(c.area * 100, c.elapsed_ns) : 0;
+	seq_printf(seq, "peak used: %lu\naverage used: %llu.%02llu\n\n",
+				c.peak, avg_used / 100, avg_used % 100);
+
+	// queueing delay followed by the latency of every producer
+	hist = kmalloc((1 + FIFO_MAX_PRODUCERS) * sizeof(struct fifo_hist), GFP_KERNEL);
+	if (0 == hist)
+		return -ENOMEM;
+
+	fifo_latency(dev, hist, hist + 1);
+
+	stats_show_hist(seq, "queueing delay", hist);
+	for (p = 0; p < READ_ONCE(dev->nr_producers); ++p)
+	{
+		seq_printf(seq, "\nlatency of %s, ", dev->producer_names[p]);
+		stats_show_hist(seq, "creation to dequeue", hist + 1 + p);
+	}
+	seq_printf(seq, "\n");
+
+	// reuses hist
+	if (dev->prio || dev->tagged)
+		stats_show_levels(seq, dev, hist);
+
+	kfree(hist);
+	return 0;
+}
+
+static int stats_open(struct inode* inode, struct file* filp)
+{
+	return single_open(filp, stats_read, PDE_DATA(inode));
+}
+
+/* 
+ * The file ops for user space stats of the queue
+ */
+static struct file_operations stat_fops = {
+	.owner =	THIS_MODULE,
+	.open =		stats_open,
+	.read =		seq_read,
+	.release =	single_release,
+};
+
+static int clients_read(struct seq_file* seq, void* v)
+{
+	int bkt;
+	struct fifo_client* c;
+	u64 now = ktime_get_ns();
+
+	seq_printf(seq, "name produced consumed bytes_in bytes_out blocked_ns idle_ms\n");
+
+	rcu_read_lock();
+	hash_for_each_rcu(clients, bkt, c, node)
+	{
+		seq_printf(seq, "%s %lu %lu %lld %lld %lld %llu\n",
+					c->name, atomic_long_read(&c->produced), atomic_long_read(&c->consumed),
+					atomic64_read(&c->bytes_in), atomic64_read(&c->bytes_out),
+					atomic64_read(&c->blocked_ns),
+					div_u64(now - READ_ONCE(c->last_active), NSEC_PER_MSEC));
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+static int clients_open(struct inode* inode, struct file* filp)
+{
+	return single_open(filp, clients_read, 0);
+}
+
+/* 
+ * The file ops for the per client stats
+ */
+static struct file_operations clients_fops = {
+	.owner =	THIS_MODULE,
+	.open =		clients_open,
+	.read =		seq_read,
+	.release =	single_release,
+};
+
+/*
+ * One line of key=value pairs for scrapers, built from fifo_snapshot only:
+ * no locks, no allocations and no histograms.
+ */
+static int metrics_read(struct seq_file* seq, void* v)
+{
+	struct fifo_snapshot c;
+
+	fifo_snapshot(&fifo, &c);
+
+	seq_printf(seq, "size=%lu used=%lu peak=%lu seq_no=%llu insertitions=%lu removals=%lu "
+				"bytes=%lu max_bytes=%lu rejected=%lu dropped=%lu expired=%lu max_lag=%lu spilled=%ld "
+				"full_waits=%lu full_spun=%lu full_wait_ns=%llu full_wait_max_ns=%llu "
+				"empty_waits=%lu empty_spun=%lu empty_wait_ns=%llu empty_wait_max_ns=%llu "
+				"write_holds=%lu write_hold_ns=%llu write_hold_max_ns=%llu "
+				"read_holds=%lu read_hold_ns=%llu read_hold_max_ns=%llu "
+				"occupancy_area=%llu elapsed_ns=%llu\n",
+				c.size, c.used, c.peak, c.seq_no, c.insertitions, c.removals,
+				c.bytes, c.max_bytes, c.rejected, c.dropped, c.expired, c.max_lag,
+				atomic_long_read(&spill_items), c.full.waits, c.full.spun, c.full.total_ns, c.full.max_ns,
+				c.empty.waits, c.empty.spun, c.empty.total_ns, c.empty.max_ns,
+				c.write.count, c.write.total_ns, c.write.max_ns,
+				c.read.count, c.read.total_ns, c.read.max_ns,
+				c.area, c.elapsed_ns);
+	return 0;
+}
+
+static int metrics_open(struct inode* inode, struct file* filp)
+{
+	return single_open(filp, metrics_read, 0);
+}
+
+/* 
+ * The file ops for the machine-readable stats
+ */
+static struct file_operations metrics_fops = {
+	.owner =	THIS_MODULE,
+	.open =		metrics_open,
+	.read =		seq_read,
+	.release =	single_release,
+};
+
+/*
+ * The sampled time series, oldest first.
+ * The ring is copied under the lock, printing happens outside of it.
+ */
+static int samples_read(struct seq_file* seq, void* v)
+{
+	unsigned int i, n, first;
+	unsigned long flags;
+	struct fifo_sample* copy;
+
+	seq_printf(seq, "time_ns used enq_per_s deq_per_s\n");
+
+	if (0 == samples)
+		return 0;
+
+	copy = kmalloc_array(sample_count, sizeof(struct fifo_sample), GFP_KERNEL);
+	if (0 == copy)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&samples_lock, flags);
+	n = sample_filled;
+	first = (sample_next + sample_count - n) % sample_count;
+	for (i = 0; i < n; ++i)
+		copy[i] = samples[(first + i) % sample_count];
+	spin_unlock_irqrestore(&samples_lock, flags);
+
+	for (i = 0; i < n; ++i)
+		seq_printf(seq, "%llu %lu %lu %lu\n",
+					copy[i].time, copy[i].used, copy[i].enq_rate, copy[i].deq_rate);
+
+	kfree(copy);
+	return 0;
+}
+
+static int samples_open(struct inode* inode, struct file* filp)
+{
+	return single_open(filp, samples_read, 0);
+}
+
+/* 
+ * The file ops for the occupancy time series
+ */
+static struct file_operations samples_fops = {
+	.owner =	THIS_MODULE,
+	.open =		samples_open,
+	.read =		seq_read,
+	.release =	single_release,
+};
+
+/*
+ * The queued items from front to end, one peek per line, so no lock is
+ * held while the output is copied to user space. Items that are read
+ * meanwhile may be skipped or shown twice.
+ */
+static void* contents_start(struct seq_file* seq, loff_t* pos)
+{
+	struct data_item* di = fifo_peek(&fifo, *pos);
+
+	if (IS_ERR(di) && PTR_ERR(di) == -ENOENT)
+		return 0;
+	return di;
+}
+
+static void* contents_next(struct seq_file* seq, void* v, loff_t* pos)
+{
+	free_di(v);
+	++*pos;
+	return contents_start(seq, pos);
+}
+
+static void contents_stop(struct seq_file* seq, void* v)
+{
+	if (v && !IS_ERR(v))
+		free_di(v);
+}
+
+static int contents_show(struct seq_file* seq, void* v)
+{
+	struct data_item* di = v;
 
-// ptr to the dev class registered within the kernel
-static struct class* dev_class;
+	seq_printf(seq, "%lu,%llu,%u,%u,%llu,%s\n", di->qid, di->time, di->prio, di->tag,
+				div_u64(ktime_get_ns() - di->enq_ns, NSEC_PER_USEC), di->msg);
+	return 0;
+}
 
-// the acquired dev number (minor and major), dev_open checks for it
-static dev_t dev_no;
+static const struct seq_operations contents_ops = {
+	.start =	contents_start,
+	.next =		contents_next,
+	.stop =		contents_stop,
+	.show =		contents_show,
+};
 
-// name of the LKM
-static char* mod_name = "deeds_fifo";
+static int contents_open(struct inode* inode, struct file* filp)
+{
+	return seq_open(filp, &contents_ops);
+}
 
-// module parameter to configure the fifo size
-static size_t size = 0;
-module_param(size, ulong, 0);
-// -------- globals end --------------------------------------------------
+/* 
+ * The file ops for the queued items, as qid,time,prio,tag,age in us,msg
+ */
+static struct file_operations contents_fops = {
+	.owner =	THIS_MODULE,
+	.open =		contents_open,
+	.read =		seq_read,
+	.llseek =	seq_lseek,
+	.release =	seq_release,
+};
 
-// -------- exported functions, fifo access ------------------------------
+static int size_read(struct seq_file* seq, void* v)
+{
+	seq_printf(seq, "%lu\n", READ_ONCE(fifo.size));
+	return 0;
+}
+
+static int size_open(struct inode* inode, struct file* filp)
+{
+	return single_open(filp, size_read, 0);
+}
 
 /*
- * If space is available, the given input is inserted at fifo.end
- *
- * @input: the data item to be insterted
- * @name: 	name of the calling lkm (obtained from THISMODULE),
- * 			or 0 for user space.
- * 
- * returns:
- *	0 on success
- *	see fifo_write
+ * Resize the fifo to the capacity written, see fifo_resize
  */
-static int put(struct data_item* input, const char* name)
+static ssize_t size_write(struct file* filp, const char __user* buf, size_t count, loff_t* off)
 {
-	return fifo_write(&fifo, input, name);
+	int err;
+	unsigned long new_size;
+
+	err = kstrtoul_from_user(buf, count, 0, &new_size);
+	if (err)
+		return err;
+
+	err = fifo_resize(&fifo, new_size);
+	if (err)
+		return -err;
+
+	printk(KERN_INFO "--- %s: resized to %lu.\n", mod_name, new_size);
+	return count;
 }
-EXPORT_SYMBOL(put);
+
+/* 
+ * The file ops for the capacity control, readable and writable
+ */
+static struct file_operations size_fops = {
+	.owner =	THIS_MODULE,
+	.open =		size_open,
+	.read =		seq_read,
+	.write =	size_write,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
+// -------- stats end ----------------------------------------------------
+
+// -------- queue control ------------------------------------------------
 
 /*
- * If the fifo is not empty, output will be the item at fifo.front
+ * Initialize dev with size items and apply the module parameters,
+ * for the default fifo and the named queues alike.
  *
- * @name: 	name of the calling lkm (obtained from THISMODULE),
- * 			or 0 for user space.
- * 
  * returns:
- *	ptr to a data_item on success
- *	ERR_PTR(see fifo_read)
+ *	see fifo_init
  */
-struct data_item* get(const char* name)
+static int fifo_mod_init_dev(struct fifo_dev* dev, size_t size)
 {
-	return fifo_read(&fifo, name);	
-}
-EXPORT_SYMBOL(get);
+	int err;
 
-int request_kill_read(const char* name)
-{
-	return fifo_request_kill_read(&fifo, name);
+	if (sharded)
+		err = fifo_init_sharded(dev, size, nr_cpu_ids);
+	else if (levels > 1)
+		err = fifo_init_prio(dev, size, levels);
+	else if (channels)
+		err = fifo_init_tagged(dev, size, channels);
+	else
+		err = fifo_init(dev, size);
+	if (err)
+		return err;
+
+	fifo_set_combining(dev, combine);
+	fifo_set_spin(dev, (u64)spin_us * NSEC_PER_USEC);
+	fifo_set_max_bytes(dev, max_bytes);
+	fifo_set_policy(dev, policy);
+	fifo_set_aging(dev, aging);
+	fifo_set_ttl(dev, (u64)ttl_ms * NSEC_PER_MSEC);
+	return fifo_set_pubsub(dev, pubsub);
 }
-EXPORT_SYMBOL(request_kill_read);
 
-int request_kill_write(const char* name)
+/*
+ * Queue names become parts of file names
+ */
+static int queue_name_valid(const char* name)
 {
-	return fifo_request_kill_write(&fifo, name);
+	size_t i, len = strlen(name);
+
+	if (0 == len || len >= FIFO_QUEUE_NAME_LEN)
+		return 0;
+
+	for (i = 0; i < len; ++i)
+		if (!isalnum(name[i]) && name[i] != '_' && name[i] != '-')
+			return 0;
+	return 1;
 }
-EXPORT_SYMBOL(request_kill_write);
-// -------- exported functions, fifo access end ------------------------------
 
-// -------- user space access --------------------------------------------
 /*
- * checks if the right device trys to access the queue
- *
- * returns:
- *	ENODEV if the opening device node has the wrong major or minor number
- * 	0 on success
+ * Tear down a queue that has been taken out of queues and queue_minors.
+ * Needs queues_lock, so the minor is not reused meanwhile.
  */
-static int dev_open(struct inode* inode, struct file* filp)
+static void queue_destroy(struct fifo_queue* q)
 {
-	if (imajor(inode) != MAJOR(dev_no) || iminor(inode) != MINOR(dev_no))
-	{
-		printk(KERN_INFO "---- %s: dev_open failed, wrong device number(s)!\n", mod_name);
-		return ENODEV;
-	}
+	device_destroy(dev_class, MKDEV(MAJOR(dev_no), q->minor));
+	cdev_del(q->cdev);
+	proc_remove(q->stats);
 
-	filp->private_data = &fifo;
+	// lookups may still be looking at q
+	synchronize_rcu();
 
-	return 0;
+	fifo_destroy(&q->dev);
+	kfree(q);
 }
+
 /*
- * Implements user read.
- * Forces reading of one data_item by returning 0 on any file offset > 0.
+ * Create the named queue name with size items (0 for the default size)
  *
  * returns:
- * 	number of read bytes on success, 0 on second try
- * 	-EFAULT if copy_to_user failed
- *	see get
+ *	EINVAL if name is not made of letters, digits, '_' and '-'
+ *	EEXIST if there is a queue name already
+ *	ENOSPC if all FIFO_MAX_QUEUES queues exist
+ *	ENOMEM or see fifo_init
+ *	0 on success
  */
-static ssize_t dev_read(struct file *file, char *buf, size_t count, loff_t *ppos)
+static int queue_create(const char* name, size_t size)
 {
-	char* return_str;
-	struct data_item* di;
-	ssize_t real_count = 0;
+	int err;
+	unsigned int minor;
+	struct fifo_queue* q;
+	struct device* device;
 
-	// only one read!
-	if (*ppos != 0)		// possible race condition? file.ppos should (TM) be per thread?
-		return 0;
+	if (!queue_name_valid(name))
+		return EINVAL;
 
-	// read from fifo
-	di = get(0);
-	if (IS_ERR(di))
-		return -PTR_ERR(di);
+	mutex_lock(&queues_lock);
 
-	return_str = kmalloc(count * sizeof(char), GFP_KERNEL);
-	real_count = snprintf(return_str, count, "[%lu][%llu] %s",
-							di->qid, di->time, di->msg);
+	err = EEXIST;
+	if (queue_find(name))
+		goto out;
 
-	// free the memory not needed anymore
-	free_di(di);
+	err = ENOSPC;
+	for (minor = 1; minor <= FIFO_MAX_QUEUES; ++minor)
+		if (0 == rcu_access_pointer(queue_minors[minor]))
+			break;
+	if (minor > FIFO_MAX_QUEUES)
+		goto out;
+
+	// fifo_init wants a zeroed fifo_dev
+	err = ENOMEM;
+	q = kzalloc(sizeof(struct fifo_queue), GFP_KERNEL);
+	if (0 == q)
+		goto out;
+
+	strlcpy(q->name, name, FIFO_QUEUE_NAME_LEN);
+	refcount_set(&q->users, 1);
+	q->minor = minor;
+
+	err = fifo_mod_init_dev(&q->dev, size);
+	if (err)
+		goto out_free;
 
-	if (copy_to_user(buf, return_str, real_count))
+	err = ENOMEM;
+	q->stats = proc_create_data(name, 0444, proc_queues, &stat_fops, &q->dev);
+	if (0 == q->stats)
+		goto out_fifo;
+
+	q->cdev = cdev_alloc();
+	if (0 == q->cdev)
+		goto out_stats;
+	q->cdev->owner = THIS_MODULE;
+	q->cdev->ops = &dev_fops;
+
+	err = -cdev_add(q->cdev, MKDEV(MAJOR(dev_no), minor), 1);
+	if (err)
+		goto out_cdev;
+
+	// add /dev/deeds_fifo_<name>
+	device = device_create(dev_class, 0, MKDEV(MAJOR(dev_no), minor), 0, DEV_NAME "_%s", name);
+	if (IS_ERR(device))
 	{
-		printk(KERN_INFO "--- %s: dev_read; copy_to_user failed!\n", mod_name);
-		real_count = -EFAULT;
+		err = -PTR_ERR(device);
+		goto out_cdev;
 	}
 
-	*ppos = real_count;
+	hash_add_rcu(queues, &q->node, queue_key(name));
+	rcu_assign_pointer(queue_minors[minor], q);
 
-	kfree(return_str);
-	return real_count;
+	mutex_unlock(&queues_lock);
+	printk(KERN_INFO "--- %s: queue %s created.\n", mod_name, name);
+	return 0;
+
+out_cdev:
+	cdev_del(q->cdev);
+out_stats:
+	proc_remove(q->stats);
+out_fifo:
+	fifo_destroy(&q->dev);
+out_free:
+	kfree(q);
+out:
+	mutex_unlock(&queues_lock);
+	return err;
 }
 
 /*
- * implements user write
+ * Delete the named queue name and free the items left in it
  *
  * returns:
- * 	count on success
- * 	-EFAULT if copy_from_user failed
- *	-EINVAL if contents of buf are malformed
+ *	ENOENT if there is no queue name
+ *	EBUSY if the queue is in use (open files, blocked callers)
+ *	0 on success
  */
-static ssize_t dev_write(struct file *file, const char *buf, size_t count, loff_t *ppos)
+static int queue_delete(const char* name)
 {
-	ssize_t ret;
-	struct data_item* di;
-	char* str = kmalloc((count + 1) * sizeof(char), GFP_KERNEL);
+	int err = 0;
+	struct fifo_queue* q;
+
+	mutex_lock(&queues_lock);
 
-	if (copy_from_user(str, buf, count))
+	q = queue_find(name);
+	if (0 == q)
 	{
-		printk(KERN_INFO "--- %s: dev_write; copy_from_user failed!\n", mod_name);
-		ret = -EFAULT;
+		err = ENOENT;
 		goto out;
 	}
 
-	// force zero termination
-	str[count] = '\0'; 
-
-	// get a data_item struct
-	di = alloc_di_str(str);
-	if (IS_ERR(di))
+	// from now on queue_get fails
+	if (!refcount_dec_if_one(&q->users))
 	{
-		ret =  -PTR_ERR(di);
+		err = EBUSY;
 		goto out;
 	}
 
-	// write to fifo
-	ret = -put(di, 0);
-	if (0 == ret)
-		ret = count;
-	else
-		free_di(di);
+	hash_del_rcu(&q->node);
+	RCU_INIT_POINTER(queue_minors[q->minor], 0);
+	queue_destroy(q);
+
+	printk(KERN_INFO "--- %s: queue %s deleted.\n", mod_name, name);
 
 out:
-	kfree(str);
-	return ret;
+	mutex_unlock(&queues_lock);
+	return err;
 }
 
-static int dev_release(struct inode* inode, struct file* filp)
+/*
+ * Delete all named queues on unload; nobody can use them any more,
+ * open files and importing modules hold a reference to this module.
+ */
+static void queues_free(void)
 {
-	return 0;
+	int bkt;
+	struct hlist_node* tmp;
+	struct fifo_queue* q;
+
+	mutex_lock(&queues_lock);
+	hash_for_each_safe(queues, bkt, tmp, q, node)
+	{
+		hash_del_rcu(&q->node);
+		RCU_INIT_POINTER(queue_minors[q->minor], 0);
+		queue_destroy(q);
+	}
+	mutex_unlock(&queues_lock);
 }
 
-/* 
- * The file ops for user space fifo access
+/*
+ * One line per named queue: name, minor, size, used and users
  */
-static struct file_operations dev_fops = {
-	.owner =	THIS_MODULE,
-	.open =		dev_open,
-	.read =		dev_read,
-	.write =	dev_write,
-	.release =	dev_release,
-};
-// -------- user space access end ----------------------------------------
-
-// -------- stats --------------------------------------------------------
-static int stats_read(struct seq_file* seq, void* v)
+static int ctl_read(struct seq_file* seq, void* v)
 {
-	int relative_usage = (fifo.empty.count*100)/fifo.size;
-	seq_printf(seq, "size: %lu\nused: %d\nempty: %d\nusage percent: %d\n\ncurrent seq_no: %llu\ninsertitions: %lu\nremovals: %lu\n\naccess count: %lu\n\n",
-				fifo.size, fifo.empty.count, fifo.full.count, relative_usage, fifo.seq_no, fifo.insertitions, fifo.removals, module_refcount(THIS_MODULE));
+	int bkt;
+	struct fifo_queue* q;
+	struct fifo_snapshot c;
+
+	mutex_lock(&queues_lock);
+	hash_for_each(queues, bkt, q, node)
+	{
+		fifo_snapshot(&q->dev, &c);
+		seq_printf(seq, "%s minor: %u size: %lu used: %lu users: %u\n",
+					q->name, q->minor, c.size, c.used, refcount_read(&q->users) - 1);
+	}
+	mutex_unlock(&queues_lock);
 	return 0;
 }
 
-static int stats_open(struct inode* inode, struct file* filp)
+static int ctl_open(struct inode* inode, struct file* filp)
+{
+	return single_open(filp, ctl_read, 0);
+}
+
+/*
+ * Takes "create <name> [size]" or "delete <name>"
+ */
+static ssize_t ctl_write(struct file* filp, const char __user* buf, size_t count, loff_t* off)
 {
-	return single_open(filp, stats_read, 0);
+	int err;
+	char name[FIFO_QUEUE_NAME_LEN];
+	unsigned long qsize = 0;
+	char* str;
+
+	if (count > 64)
+		return -EINVAL;
+
+	str = memdup_user_nul(buf, count);
+	if (IS_ERR(str))
+		return PTR_ERR(str);
+
+	err = EINVAL;
+	if (sscanf(str, "create %31s %lu", name, &qsize) >= 1)
+		err = queue_create(name, qsize);
+	else if (1 == sscanf(str, "delete %31s", name))
+		err = queue_delete(name);
+
+	kfree(str);
+	return err ? -err : count;
 }
 
 /* 
- * The file ops for user space stats of the queue
+ * The file ops for creating and deleting named queues
  */
-static struct file_operations stat_fops = {
+static struct file_operations ctl_fops = {
 	.owner =	THIS_MODULE,
-	.open =		stats_open,
+	.open =		ctl_open,
 	.read =		seq_read,
+	.write =	ctl_write,
+	.llseek =	seq_lseek,
 	.release =	single_release,
 };
-// -------- stats end ----------------------------------------------------
+// -------- queue control end --------------------------------------------
+
+// -------- module tracking ----------------------------------------------
+
+/*
+ * A module that goes away no longer takes the kill requests left for
+ * it, drop them before a new module of the same name shows up
+ */
+static int module_going(struct notifier_block* nb, unsigned long action, void* data)
+{
+	int bkt;
+	struct module* mod = data;
+	struct fifo_queue* q;
+
+	if (action != MODULE_STATE_GOING)
+		return NOTIFY_DONE;
+
+	fifo_kill_forget(&fifo, mod->name);
+
+	mutex_lock(&queues_lock);
+	hash_for_each(queues, bkt, q, node)
+		fifo_kill_forget(&q->dev, mod->name);
+	mutex_unlock(&queues_lock);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block module_nb = {
+	.notifier_call = module_going,
+};
+
+// -------- module tracking end ------------------------------------------
+
+// -------- proc files ---------------------------------------------------
+
+/*
+ * All files in /proc, created in this order by create_proc_files
+ */
+static struct proc_file {
+	const char* name;
+	umode_t mode;
+	const struct file_operations* fops;
+	struct proc_dir_entry* entry;
+} proc_files[] = {
+	{ "deeds_fifo_stats", 0444, &stat_fops },
+	{ "deeds_fifo_clients", 0444, &clients_fops },
+	{ "deeds_fifo_metrics", 0444, &metrics_fops },
+	{ "deeds_fifo_samples", 0444, &samples_fops },
+	{ "deeds_fifo_contents", 0444, &contents_fops },
+	{ "deeds_fifo_size", 0644, &size_fops },
+	{ "deeds_fifo_ctl", 0644, &ctl_fops },
+};
+
+static void remove_proc_files(void)
+{
+	int i;
+
+	for (i = ARRAY_SIZE(proc_files) - 1; i >= 0; --i)
+	{
+		proc_remove(proc_files[i].entry);
+		proc_files[i].entry = 0;
+	}
+}
+
+/*
+ * returns:
+ *	-1 if one of the files could not be created, none is left then
+ *	0 on success
+ */
+static int create_proc_files(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(proc_files); ++i)
+	{
+		proc_files[i].entry = proc_create_data(
+			proc_files[i].name, proc_files[i].mode, 0, proc_files[i].fops, &fifo);
+
+		if (0 == proc_files[i].entry)
+		{
+			printk(KERN_INFO "--- %s: creation of /proc/%s failed!\n", mod_name, proc_files[i].name);
+			remove_proc_files();
+			return -1;
+		}
+	}
+	return 0;
+}
+// -------- proc files end -----------------------------------------------
 
 /*
  * destroys the device node, unregisters the cdev form the kernel
@@ -261,7 +2421,7 @@ node:	device_destroy(dev_class, dev_no);
 dev:	cdev_del(&k_c_dev);	
 class:	class_destroy(dev_class);
 
-none:	unregister_chrdev_region(dev_no, 1);
+none:	unregister_chrdev_region(dev_no, 1 + FIFO_MAX_QUEUES);
 }
 
 // function for class struct setting the permissions for the dev node
@@ -284,8 +2444,8 @@ static int create_dev_node(void)
 	int err;
 	struct device* device;
 
-	// get a major number
-	err = alloc_chrdev_region(&dev_no, 0, 1, DEV_NAME);
+	// get a major number, with minors for the named queues
+	err = alloc_chrdev_region(&dev_no, 0, 1 + FIFO_MAX_QUEUES, DEV_NAME);
 	if (err)
 		return err;
 
@@ -334,42 +2494,103 @@ static int __init fifo_mod_init(void)
 {
 	int err;
 
-	err = fifo_init(&fifo, size);
+	err = match_string(policy_names, ARRAY_SIZE(policy_names), overflow);
+	if (err < 0)
+	{
+		printk(KERN_INFO "--- %s: unknown overflow policy %s!\n", mod_name, overflow);
+		return -EINVAL;
+	}
+	policy = err;
+
+	if (sharded + (levels > 1) + (channels > 0) + pubsub > 1)
+	{
+		printk(KERN_INFO "--- %s: only one of sharded, levels, channels and pubsub!\n", mod_name);
+		return -EINVAL;
+	}
+
+	err = fifo_mod_init_dev(&fifo, size);
 	if (err)
 	{
 		printk(KERN_INFO "--- %s: fifo_init failed!\n", mod_name);	
 		return err;
 	}
 
-	proc_stats = proc_create(
-		"deeds_fifo_stats", 0444, 0, &stat_fops);
-
-	if (0 == proc_stats) 
+	err = spill_start();
+	if (err)
 	{
-		printk(KERN_INFO "--- %s: creation of /proc/deeds_fifo_stats failed!\n", mod_name);
-		fifo_destroy(&fifo);
-		return -1;
+		printk(KERN_INFO "--- %s: could not open spill file %s!\n", mod_name, spill_path);
+		goto out_fifo;
 	}
-	
+
+	checkpoint_load(&fifo);
+
+	// named queues need the device class
 	err = create_dev_node();
 	if (err)
 	{
 		printk(KERN_INFO "--- %s: cdev (and node) creation failed!\n", mod_name);	
-		proc_remove(proc_stats);
-		fifo_destroy(&fifo);
-		return err;
+		goto out_spill;
+	}
+
+	err = -ENOMEM;
+	proc_queues = proc_mkdir("deeds_fifo_queues", 0);
+	if (0 == proc_queues)
+		goto out_node;
+
+	err = create_proc_files();
+	if (err)
+		goto out_queues;
+
+	err = sampler_start();
+	if (err)
+	{
+		printk(KERN_INFO "--- %s: sampler start failed!\n", mod_name);
+		goto out_proc;
+	}
+
+	err = register_module_notifier(&module_nb);
+	if (err)
+	{
+		printk(KERN_INFO "--- %s: module notifier registration failed!\n", mod_name);
+		goto out_sampler;
 	}
 
 	printk(KERN_INFO "--- %s: is being loaded.\n", mod_name);
 	return err;
+
+out_sampler:
+	sampler_stop();
+out_proc:
+	remove_proc_files();
+out_queues:
+	proc_remove(proc_queues);
+out_node:
+	destroy_dev_node(3);
+out_spill:
+	checkpoint_save(&fifo);
+	spill_stop();
+out_fifo:
+	fifo_destroy(&fifo);
+	clients_free();
+	return err;
 }
 
 static void __exit fifo_mod_cleanup(void)
 {
+	unregister_module_notifier(&module_nb);
+
+	// readers of the samples file must be gone before the ring is freed
+	remove_proc_files();
+	sampler_stop();
+
+	queues_free();
+	proc_remove(proc_queues);
 	destroy_dev_node(3);
-	proc_remove(proc_stats);
 
+	checkpoint_save(&fifo);
+	spill_stop();
 	fifo_destroy(&fifo);
+	clients_free();
 
 	printk(KERN_INFO "--- %s: is being unloaded.\n", mod_name);
 }
@@ -0,0 +1,143 @@
+/*
+ * Tracepoints of the fifo, usable with perf trace, bpftrace and ftrace
+ * (events/deeds_fifo/). They cost a static branch while disabled.
+ * fifo.c defines CREATE_TRACE_POINTS before including this header.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM deeds_fifo
+
+#if !defined(_FIFO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _FIFO_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "data_item.h"
+
+// name is 0 for user space callers
+#define FIFO_TRACE_NAME(name) ((name) ? (name) : "user")
+
+/*
+ * an item entered or left the queue
+ * @used: occupancy after the operation
+ */
+DECLARE_EVENT_CLASS(fifo_item,
+
+	TP_PROTO(const struct data_item* item, const char* name, size_t used),
+
+	TP_ARGS(item, name, used),
+
+	TP_STRUCT__entry(
+		__field(size_t, qid)
+		__string(name, FIFO_TRACE_NAME(name))
+		__field(size_t, used)
+		__field(size_t, len)
+	),
+
+	TP_fast_assign(
+		__entry->qid = item->qid;
+		__assign_str(name, FIFO_TRACE_NAME(name));
+		__entry->used = used;
+		__entry->len = strlen(item->msg);
+	),
+
+	TP_printk("qid=%zu name=%s used=%zu len=%zu",
+		__entry->qid, __get_str(name), __entry->used, __entry->len)
+);
+
+DEFINE_EVENT(fifo_item, fifo_enqueue,
+	TP_PROTO(const struct data_item* item, const char* name, size_t used),
+	TP_ARGS(item, name, used)
+);
+
+DEFINE_EVENT(fifo_item, fifo_dequeue,
+	TP_PROTO(const struct data_item* item, const char* name, size_t used),
+	TP_ARGS(item, name, used)
+);
+
+/*
+ * a reader or writer is going to sleep on empty or full
+ * @used: occupancy when it gave up polling
+ */
+DECLARE_EVENT_CLASS(fifo_block,
+
+	TP_PROTO(const char* name, size_t used),
+
+	TP_ARGS(name, used),
+
+	TP_STRUCT__entry(
+		__string(name, FIFO_TRACE_NAME(name))
+		__field(size_t, used)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, FIFO_TRACE_NAME(name));
+		__entry->used = used;
+	),
+
+	TP_printk("name=%s used=%zu", __get_str(name), __entry->used)
+);
+
+DEFINE_EVENT(fifo_block, fifo_block_full,
+	TP_PROTO(const char* name, size_t used),
+	TP_ARGS(name, used)
+);
+
+DEFINE_EVENT(fifo_block, fifo_block_empty,
+	TP_PROTO(const char* name, size_t used),
+	TP_ARGS(name, used)
+);
+
+/*
+ * a module asked to unblock its blocked reader or writer
+ * @write: 1 for request_kill_write, 0 for request_kill_read
+ * @act: waiters unblocked, 0 if none of name was blocked
+ */
+TRACE_EVENT(fifo_kill_request,
+
+	TP_PROTO(const char* name, int write, int act),
+
+	TP_ARGS(name, write, act),
+
+	TP_STRUCT__entry(
+		__string(name, FIFO_TRACE_NAME(name))
+		__field(int, write)
+		__field(int, act)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, FIFO_TRACE_NAME(name));
+		__entry->write = write;
+		__entry->act = act;
+	),
+
+	TP_printk("name=%s %s act=%d", __get_str(name),
+		__entry->write ? "write" : "read", __entry->act)
+);
+
+/*
+ * the blocked reader or writer of name has been unblocked
+ */
+TRACE_EVENT(fifo_kill_complete,
+
+	TP_PROTO(const char* name),
+
+	TP_ARGS(name),
+
+	TP_STRUCT__entry(
+		__string(name, FIFO_TRACE_NAME(name))
+	),
+
+	TP_fast_assign(
+		__assign_str(name, FIFO_TRACE_NAME(name));
+	),
+
+	TP_printk("name=%s", __get_str(name))
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE fifo_trace
+#include <trace/define_trace.h>